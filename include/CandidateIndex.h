@@ -0,0 +1,43 @@
+#ifndef __CANDIDATE_INDEX_H
+#define __CANDIDATE_INDEX_H
+
+#include <vector>
+#include <span>
+#include <string>
+#include <array>
+#include <optional>
+#include <numeric>
+#include <algorithm>
+
+#include "Chem.h"
+
+namespace CandidateIndex {
+  constexpr double PPM_TOLERANCE = 50;
+
+  // ---- Every formula a reagent ion mask allows up to max_mz, sorted by theoretical mass ----
+  class MassIndex {
+  private:
+    ::std::vector<double> _masses;
+    ::std::vector<uint16_t> _counts; // _stride counts per entry, one for each element in the mask
+    ::std::vector<uint8_t> _elements; // chem map indeces of the mask elements
+    size_t _stride;
+    double _max_mz;
+
+  public:
+    MassIndex(const ::Chem::ReagantIonMask &mask, double max_mz);
+
+    bool covers(double mz) const;
+    size_t size() const;
+    double get_max_mz() const;
+    double get_mass(size_t entry) const;
+    ::std::span<const uint16_t> get_counts(size_t entry) const;
+    const ::std::vector<uint8_t> &get_elements() const;
+
+    void query(double mz, ::std::vector<size_t> &hits) const;
+  };
+
+  void build(::Chem::ReagantIon reagant_ion, double max_mz);
+  const MassIndex *get_index(::Chem::ReagantIon reagant_ion);
+};
+
+#endif
@@ -6,14 +6,135 @@
 #include <string>
 #include <algorithm>
 #include <vector>
+#include <array>
+#include <cstring>
+#include <span>
+#include <string_view>
 
 namespace Chem {
   constexpr uint8_t N_CRITEREA = 4;
+  constexpr uint8_t CRITEREA_ALL_PASSED = (1 << N_CRITEREA) - 1;
   constexpr uint8_t TOTAL_CHEMS = 13;
   constexpr uint8_t PTR_END_IDX = 4;
   constexpr uint8_t POLYATOMIC_START_IDX = 9;
   constexpr uint8_t CHARGE = 8;
   constexpr double CHEM_SCALE_FACTOR = .01;
+  constexpr double PPM_NORMALIZATION_FACTOR = 1e6;
+
+  // ---- Element counts of a compound (indexed like ChemMap::get_chems), packed into one 256-bit lane ----
+  struct alignas(32) Compound {
+    ::std::array<uint16_t, 16> counts{}; // only the first TOTAL_CHEMS are used, the rest stay 0
+
+    uint16_t &operator[](size_t i) { return counts[i]; }
+    uint16_t operator[](size_t i) const { return counts[i]; }
+
+    bool operator==(const Compound &other) const {
+      return ::std::memcmp(counts.data(), other.counts.data(), sizeof(counts)) == 0;
+    }
+  };
+
+  static_assert(sizeof(Compound) == 32, "Compound must fit a single 256-bit lane");
+
+  using CompoundList = ::std::vector<Compound>;
+
+  // ---- Model feature value of an element count (same value the combo file text parses back to) ----
+  constexpr double count_to_feature(uint16_t count) {
+    return count / (1 / CHEM_SCALE_FACTOR);
+  }
+
+  // ---------------------
+  // Element Table
+  // ---------------------
+
+  /* The elements are sorted by mass in ascending order for the elemental combo search
+     PROPER_ORDERING can be used in Preprocess::decode_compounds to maintain standard chemical order
+     in the decoded compound */
+  constexpr ::std::array<::std::string_view, TOTAL_CHEMS> CHEM_SYMBOLS = {
+    "H", "C", "N", "O", "F", "Si", "S", "Cl", "+", "NH4", "NH3", "H3O", "H2O"
+  };
+
+  constexpr ::std::array<double, TOTAL_CHEMS> CHEM_MASSES = {
+    1.00782503, 12, 14.003074, 15.99491462, 18.998403163, 27.97692653465, 31.97207117, 34.968852682,
+    -0.000548, 18.03437412, 17.02654909, 19.01838971, 18.01056468
+  };
+
+  constexpr ::std::array<uint8_t, TOTAL_CHEMS> PROPER_ORDERING = { 9, 10, 11, 12, 1, 7, 4, 0, 2, 3, 6, 5, 8 };
+
+  // ---- Index of a chemical symbol, TOTAL_CHEMS if it isn't in the table ----
+  constexpr uint8_t find_chem_idx(::std::string_view chemical) {
+    for (uint8_t i{}; i < TOTAL_CHEMS; i++) {
+      if (CHEM_SYMBOLS[i] == chemical)
+	return i;
+    }
+
+    return TOTAL_CHEMS;
+  }
+
+  // Compile time indeces of the chemicals in a Compound
+  namespace ChemIdx {
+    constexpr uint8_t H = find_chem_idx("H");
+    constexpr uint8_t C = find_chem_idx("C");
+    constexpr uint8_t N = find_chem_idx("N");
+    constexpr uint8_t O = find_chem_idx("O");
+    constexpr uint8_t F = find_chem_idx("F");
+    constexpr uint8_t Si = find_chem_idx("Si");
+    constexpr uint8_t S = find_chem_idx("S");
+    constexpr uint8_t Cl = find_chem_idx("Cl");
+    constexpr uint8_t NH4 = find_chem_idx("NH4");
+    constexpr uint8_t NH3 = find_chem_idx("NH3");
+    constexpr uint8_t H3O = find_chem_idx("H3O");
+    constexpr uint8_t H2O = find_chem_idx("H2O");
+  };
+
+  static_assert(find_chem_idx("+") == CHARGE && ChemIdx::NH4 == POLYATOMIC_START_IDX, "Element table doesn't match the index constants");
+
+  // ---- Elements that make up each polyatomic, indexed from POLYATOMIC_START_IDX ----
+  constexpr Compound make_composition(uint16_t n_hydrogen, uint16_t n_nitrogen, uint16_t n_oxygen) {
+    Compound composition{};
+    composition.counts[ChemIdx::H] = n_hydrogen;
+    composition.counts[ChemIdx::N] = n_nitrogen;
+    composition.counts[ChemIdx::O] = n_oxygen;
+    return composition;
+  }
+
+  constexpr ::std::array<Compound, TOTAL_CHEMS - POLYATOMIC_START_IDX> POLYATOMIC_COMPOSITIONS = {
+    make_composition(4, 1, 0), // NH4
+    make_composition(3, 1, 0), // NH3
+    make_composition(3, 0, 1), // H3O
+    make_composition(2, 0, 1)  // H2O
+  };
+
+  constexpr size_t N_FACTORED_POLYATOMICS = 1; // only ammonium is factored out of candidates
+
+  // ---- Expand the polyatomics of a compound into their elements ----
+  constexpr void simplify_compound(Compound &compound) {
+    for (size_t j = POLYATOMIC_START_IDX; j < TOTAL_CHEMS; j++) {
+      uint16_t n_poly = compound.counts[j];
+      if (n_poly == 0)
+	continue;
+
+      const auto &poly = POLYATOMIC_COMPOSITIONS[j - POLYATOMIC_START_IDX];
+      for (size_t k{}; k < POLYATOMIC_START_IDX; k++)
+	compound.counts[k] += poly.counts[k] * n_poly;
+      compound.counts[j] = 0;
+    }
+  }
+
+  // ---- Factor one of each factored polyatomic out of a compound if its elements are there ----
+  constexpr void factor_compound(Compound &compound) {
+    for (size_t j{}; j < N_FACTORED_POLYATOMICS; j++) {
+      const auto &poly = POLYATOMIC_COMPOSITIONS[j];
+      bool contains_polyatomic{ true };
+      for (size_t k{}; k < TOTAL_CHEMS; k++)
+	contains_polyatomic &= compound.counts[k] >= poly.counts[k];
+
+      if (contains_polyatomic) {
+	compound.counts[POLYATOMIC_START_IDX + j]++;
+	for (size_t k{}; k < TOTAL_CHEMS; k++)
+	  compound.counts[k] -= poly.counts[k];
+      }
+    }
+  }
 
   struct unenc_compound {  
     std::string val;
@@ -25,22 +146,27 @@ namespace Chem {
     bool did_pass;
   };
 
+  // ---- Reagent ions SoarAI supports, NONE marks a compound none of them could have produced ----
+  enum class ReagantIon : uint8_t { NH4, NO, NONE };
+  constexpr size_t N_REAGANT_IONS = 2;
+
+  using ElementMask = uint16_t; // bit i is element i of ChemMap::get_chems
+  constexpr ElementMask DETECTABLE_ELEMENTS = (1 << POLYATOMIC_START_IDX) - 1; // elements a reagent ion can rule out
+
   struct ReagantIonMask {
-    ::std::unique_ptr<uint8_t[]> indeces;
+    ::std::array<uint8_t, TOTAL_CHEMS> indeces; // the first length are used
     uint8_t length;
+    ElementMask elements;
   };
 
+  // ---- Runtime view over the element table and the reagent ion masks ----
   class ChemMap {
   private:
-    ::std::vector<double> _masses;
     ::std::vector<std::string> _chemicals;
-    ::std::vector<unenc_compound> _reagant_ions;
-    ::std::array<uint8_t, TOTAL_CHEMS> _proper_ordering;
+    ::std::vector<ReagantIon> _reagant_ions;
+    ::std::array<::std::string, N_REAGANT_IONS> _reagant_ion_names;
 
-    ::std::map<std::string, double> _chem_masses;
-    ::std::map<std::string, double> _chem_idx;
-
-    ::std::map<::std::string, ReagantIonMask> _ion_masks;
+    ::std::array<ReagantIonMask, N_REAGANT_IONS> _ion_masks;
 
     ChemMap();
 
@@ -52,27 +178,78 @@ namespace Chem {
     ChemMap(ChemMap &&other) = delete;
     ChemMap &operator=(ChemMap &&other) = delete;
 
-    double get_mass(std::string chemical);
-    size_t get_idx(std::string chemical);
-    const ReagantIonMask &get_reagant_ion_mask(unenc_compound reagant_ion);
+    double get_mass(::std::string_view chemical);
+    size_t get_idx(::std::string_view chemical);
+    const ReagantIonMask &get_reagant_ion_mask(ReagantIon reagant_ion);
 
-    const ::std::vector<unenc_compound> &get_reagant_ions();
-    const ::std::vector<double> &get_masses();
+    const ::std::vector<ReagantIon> &get_reagant_ions();
+    ReagantIon get_reagant_ion(::std::string_view name);
+    const ::std::string &get_reagant_ion_name(ReagantIon reagant_ion);
+    const ::std::array<double, TOTAL_CHEMS> &get_masses();
     const ::std::vector<std::string> &get_chems();
     const ::std::array<uint8_t, TOTAL_CHEMS> &get_proper_ordering();
 
-    unenc_compound find_reagant_ion(::std::span<double> &encoded_compound_view);
+    ReagantIon find_reagant_ion(const Compound &encoded_compound);
   };
   
-  bool compounds_are_equal(const ::std::span<double> &compound1,
-			   const ::std::span<double> &compound2);
-  bool uses_reagant_ion(const ::std::span<double> &encoded_unsimplified_view,
-			unenc_compound reagant_ion);
+  // ---- The 4 criterea on the counts they read, bit k is set if criterea k passed ----
+  constexpr uint8_t criterea_bits_of(uint32_t n_hydrogen,
+				     uint32_t n_carbon,
+				     uint32_t n_nitrogen,
+				     uint32_t n_nh4,
+				     uint32_t n_nh3) {
+    uint8_t criterea_bits = CRITEREA_ALL_PASSED;
+
+    if (n_nh4 > 0) {
+      // has NH4 and the number of hydrogen is odd
+      if (n_hydrogen % 2 == 1)
+	criterea_bits &= ~(1 << 0);
+
+      // has NH4 and the number of hydrogen is greater than 2 + number of carbon
+      if (n_hydrogen > (2 * n_carbon) + 2)
+	criterea_bits &= ~(1 << 1);
+    }
+
+    if (n_nitrogen == 0 && n_nh4 == 0 && n_nh3 == 0) {
+      // no nitrogen and number of hydrogen is even
+      if (n_hydrogen % 2 == 0)
+	criterea_bits &= ~(1 << 2);
+
+      // no nitrogen and number of hydrogen is greater than 2 times number of carbon plus 3
+      if (n_hydrogen > (2 * n_carbon) + 3)
+	criterea_bits &= ~(1 << 3);
+    }
+
+    return criterea_bits;
+  }
+
+  // ---- Structure of arrays view of the counts the criterea read, one entry per candidate ----
+  struct CritereaCounts {
+    const uint16_t *hydrogen;
+    const uint16_t *carbon;
+    const uint16_t *nitrogen;
+    const uint16_t *nh4;
+    const uint16_t *nh3;
+  };
+
+  bool compounds_are_equal(const Compound &compound1,
+			   const Compound &compound2);
+  ElementMask get_element_mask(const Compound &compound);
+  bool uses_reagant_ion(const Compound &encoded_unsimplified,
+			ReagantIon reagant_ion);
   double get_ppm(double observed_mz, double theoretical_mz);
-  double get_compound_mass(const ::std::span<double> &compound);
-  CritereaCheckRes check_criterea(const ::std::span<double> &compound);
-  CritereaCheckRes check_criterea(const ::CNum::DataStructs::Matrix<double> &compound);
-  ::CNum::DataStructs::Matrix<double> factor_polyatomics(const ::CNum::DataStructs::Matrix<double> &encoded_simplified);
+  double get_compound_mass(const Compound &compound);
+  void write_features(const Compound &compound, double *out);
+  CritereaCheckRes check_criterea(const Compound &compound);
+  uint8_t get_criterea_bits(const Compound &compound);
+  void check_criterea_batch(const CritereaCounts &counts, size_t n, uint8_t *out_bits);
+  void get_criterea_bits_batch(::std::span<const Compound> compounds, uint8_t *out_bits);
+  void get_compound_masses(::std::span<const Compound> compounds, double *out_masses);
+  void get_ppms(double observed_mz, ::std::span<const double> theoretical_mzs, double *out_ppms);
+  CompoundList factor_polyatomics(const CompoundList &encoded_simplified);
+  void factor_polyatomics_in_place(::std::span<Compound> compounds);
+  void simplify_compounds_in_place(::std::span<Compound> compounds);
+  void simplify_and_factor(::std::span<const Compound> compounds, Compound *simplified, Compound *factored);
 };
 
 #endif
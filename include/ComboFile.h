@@ -0,0 +1,65 @@
+#ifndef __COMBO_FILE_H
+#define __COMBO_FILE_H
+
+#include <CNum.h>
+#include <array>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <filesystem>
+
+#include "Chem.h"
+#include "FileUtils.h"
+
+/* Binary combo file layout (native byte order):
+     Header
+     one column after another, each starting on an 8 byte boundary
+       criteria:  N_CRITEREA bit columns
+       counts:    TOTAL_CHEMS uint16 columns
+       ppm:       one float64 column
+       label:     one bit column
+   Bit columns pack row i into bit (i % 8) of byte (i / 8) */
+
+namespace ComboFile {
+  enum class Format { CSV, BINARY };
+  enum class ColumnType : uint8_t { BIT, UINT16, FLOAT64 };
+
+  constexpr char MAGIC[8] = { 'S', 'O', 'A', 'R', 'C', 'M', 'B', '\0' };
+  constexpr uint32_t VERSION = 1;
+  constexpr size_t MAX_COLUMNS = 32;
+  constexpr size_t N_COLUMNS = ::Chem::N_CRITEREA + ::Chem::TOTAL_CHEMS + 2; // + ppm and label
+  constexpr size_t N_FEATURES = N_COLUMNS - 1;
+  static_assert(N_COLUMNS <= MAX_COLUMNS);
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_features;
+    uint64_t n_rows;
+    char reagant_ion[8];
+    ColumnType column_types[MAX_COLUMNS];
+  };
+  static_assert(sizeof(Header) == 64);
+
+  // ---- Rows of a combo file kept compact until they're written ----
+  struct Rows {
+    ::std::vector<uint8_t> crit_masks; // bit k is criterea k
+    ::Chem::CompoundList compounds; // unsimplified
+    ::std::vector<double> ppms;
+    ::std::vector<uint8_t> labels;
+
+    void push_back(uint8_t crit_bits, const ::Chem::Compound &compound, double ppm, bool label);
+    void append(const Rows &other);
+    void clear();
+    size_t size() const;
+  };
+
+  Format parse_format(const ::std::string &format);
+  ::std::string get_extension(Format format);
+  void write(const ::std::string &path, ::Chem::ReagantIon reagant_ion, const Rows &rows);
+  ::std::array<::CNum::DataStructs::Matrix<double>, 2> load(const ::std::string &path);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef __FILE_UTILS_H
+#define __FILE_UTILS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <charconv>
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <chrono>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace FileUtils {
+  constexpr size_t MIN_CHUNK_SIZE = 1 << 20; // 1 MiB, smaller chunks aren't worth a thread
+  constexpr size_t WRITE_BLOCK_SIZE = 1 << 20; // 1 MiB
+
+  // ---- Read only memory mapping of a whole file, unmapped on destruction ----
+  class MappedFile {
+  private:
+    const char *_data{ nullptr };
+    size_t _size{ 0 };
+
+  public:
+    MappedFile(const ::std::string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &other) = delete;
+    MappedFile &operator=(const MappedFile &other) = delete;
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    ::std::string_view view() const;
+    size_t size() const;
+  };
+
+  // ---- Append only file written in WRITE_BLOCK_SIZE blocks from a fixed buffer, for one thread ----
+  class BlockWriter {
+  private:
+    int _fd{ -1 };
+    ::std::string _path;
+    ::std::unique_ptr<char[]> _buffer;
+    size_t _used{ 0 };
+    size_t _size{ 0 };
+
+  public:
+    BlockWriter(const ::std::string &path);
+    ~BlockWriter();
+    BlockWriter(const BlockWriter &other) = delete;
+    BlockWriter &operator=(const BlockWriter &other) = delete;
+
+    void append(const char *data, size_t n_bytes);
+    void flush();
+    size_t size() const;
+    const ::std::string &get_path() const;
+  };
+
+  // ---- Anonymous in memory file (memfd) that a child process can open by path once it inherits the descriptor ----
+  class MemFile {
+  private:
+    int _fd{ -1 };
+
+  public:
+    MemFile(const char *name);
+    ~MemFile();
+    MemFile(const MemFile &other) = delete;
+    MemFile &operator=(const MemFile &other) = delete;
+
+    int fd() const;
+    ::std::string child_path() const;
+    void write(::std::string_view bytes);
+    ::std::string read_all() const;
+  };
+
+  // ---- Limits on what a directory of audit files may hold, 0 means no limit ----
+  struct RetentionPolicy {
+    size_t max_files;
+    uintmax_t max_bytes;
+    ::std::chrono::hours max_age;
+  };
+
+  ::std::string_view next_line(::std::string_view &text);
+  ::std::vector<::std::string_view> split_into_chunks(::std::string_view text, size_t max_chunks, size_t min_chunk_size = MIN_CHUNK_SIZE);
+  ::std::string_view get_field(::std::string_view line, size_t col, char delim = '\t');
+  bool parse_double(::std::string_view field, double &value);
+  size_t enforce_retention(const ::std::string &dir, const RetentionPolicy &policy);
+};
+
+#endif
@@ -12,32 +12,97 @@
 #include <cmath>
 #include <yaml-cpp/yaml.h>
 #include <filesystem>
+#include <numeric>
+#include <unordered_set>
+#include <charconv>
+#include <bit>
+#include <limits>
 
 #include "Preprocess.h"
 #include "Postprocess.h"
 #include "SysUtils.h"
 #include "Chem.h"
+#include "ResultCache.h"
+#include "ResponseWriter.h"
+#include "PeakFit.h"
 
 namespace InferenceAPI {
   constexpr int N_FILES = 2; // 2 files for mz_av and mz_base
   constexpr size_t MAX_FILE_SIZE = 7 * (1 << 20); // 7 MiB
+  constexpr double MAX_MZ = 1000.0; // largest m/z a request can ask for, candidate enumeration grows steeply with m/z
+  constexpr size_t MODEL_FEATURES = ::Chem::N_CRITEREA + ::Chem::TOTAL_CHEMS + 1; // criterea, counts and ppm, as written by mz_to_data_batch
   
   const ::std::array<size_t, 3> TABLE_WIDTHS = { 15, 11, 11 };
   const ::std::array<::std::string, 3> TABLE_HEADERS = { "Ion", "PPM", "Confidence" };
   constexpr size_t TABLE_MARGIN = 1;
   constexpr size_t TABLE_N_COLS = 3;
 
+  /* Binary request body (Content-Type application/octet-stream, little endian):
+       BinaryRequestHeader
+       n_mz float64 m/z values
+     top_k, min_score, page_size and cursor are passed in the query string */
+  constexpr ::std::string_view BINARY_REQUEST_CONTENT_TYPE = "application/octet-stream";
+  constexpr char REQUEST_MAGIC[8] = { 'S', 'O', 'A', 'R', 'R', 'E', 'Q', '\0' };
+  constexpr uint32_t REQUEST_VERSION = 1;
+
+  struct BinaryRequestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    char reagant_ion[8]; // NUL padded
+    uint64_t n_mz;
+  };
+  static_assert(sizeof(BinaryRequestHeader) % sizeof(double) == 0); // keeps the m/z values aligned
+
+  // ---- A parsed predict request, mz_values may point straight into the request body ----
+  struct PredictRequest {
+    ::Chem::ReagantIon reagant_ion{ ::Chem::ReagantIon::NONE };
+    ::std::span<const double> mz_values;
+    ::std::vector<double> mz_storage; // backs mz_values when they can't be used in place
+    ::Postprocess::RankOptions rank_options;
+    ::std::string cursor;
+  };
+
+  struct CachedResult {
+    double mz;
+    ::std::shared_ptr<const ::ResultCache::Entry> entry;
+  };
+
   struct Storage {
-    ::CNum::DataStructs::Matrix<double> encoded_compounds;
+    ::Chem::CompoundList encoded_compounds;
     ::CNum::DataStructs::Matrix<double> ppms;
     ::CNum::DataStructs::Matrix<uint8_t> criterea_encodings;
+
+    // Result cache bookkeeping
+    ::Chem::ReagantIon reagant_ion{ ::Chem::ReagantIon::NONE };
+    ::std::vector<double> mz; // m/z values that went through the model
+    ::std::vector<size_t> row_offsets;
+    ::std::vector<double> theoretical_masses;
+    ::std::vector<CachedResult> cached; // m/z values answered from the cache
+    bool model_placeholder{ false }; // the model only got a placeholder row, every answer came from the cache
+
+    // Ranking of this request
+    ::Postprocess::RankOptions rank_options;
+    uint64_t request_fingerprint{ 0 }; // cursors are only valid for the request that made them
   };
 
   extern char *python_executable_path; // to be used to c code hence the NULL over nulltpr
   extern ::std::string graph_upload_dir;
   extern ::std::string peak_output_dir;
+  extern ::ResultCache::ShardedLRU *result_cache; // nullptr when the cache is disabled
+  extern ::Postprocess::RankOptions default_rank_options; // used when a request doesn't set its own
+  extern ::PeakFit::Engine peak_fit_engine;
+  extern ::PeakFit::Options peak_fit_options;
+  extern double peak_fit_validation_ppm; // native peaks this close to a python peak count as the same peak
+  extern PeakFitWorkerPool *peak_fit_workers; // nullptr when the python tool is run once per request
+  extern bool audit_enabled; // uploads and detected peaks are written to disk
+  extern ::FileUtils::RetentionPolicy audit_retention;
 
   void resolve_paths(const ::YAML::Node &config);
+  void init_result_cache(const ::YAML::Node &config);
+  void init_ranking(const ::YAML::Node &config);
+  void init_peak_fit(const ::YAML::Node &config);
+  void init_audit(const ::YAML::Node &config);
   
   ::CNum::DataStructs::Matrix<double> preprocess_func(crow::json::rvalue &req_body,
 						      crow::json::wvalue &res_body,
@@ -45,9 +110,15 @@ namespace InferenceAPI {
   void postprocess_func(::CNum::DataStructs::Matrix<double> &preds,
 			crow::json::wvalue &res_body,
 			Storage &storage);
+  void predict_stream(const crow::request &req,
+		      crow::response &res,
+		      ::CNum::Model::Tree::GBModel< ::CNum::Model::Tree::XGTreeBooster > *model);
   void process_graph(const crow::request &req,
 		     crow::response &res,
 		     ::CNum::Model::Tree::GBModel< ::CNum::Model::Tree::XGTreeBooster > *model);
+  void cache_stats(const crow::request &req,
+		   crow::response &res,
+		   ::CNum::Model::Tree::GBModel< ::CNum::Model::Tree::XGTreeBooster > *model);
 }
  
 #endif
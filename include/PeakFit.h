@@ -0,0 +1,80 @@
+#ifndef __PEAK_FIT_H
+#define __PEAK_FIT_H
+
+#include <span>
+#include <deque>
+#include <cmath>
+#include <array>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <cctype>
+#include <string_view>
+
+/* In process peak detection and fitting for uploaded spectra
+     1. a rolling minimum smoothed by a rolling mean of the same window is taken as the baseline and subtracted
+     2. local maxima of the baseline subtracted signal that rise min_snr times its noise (scaled MAD) above both the
+	noise floor and the lowest point between them and the next higher point on each side are peaks
+     3. each peak is least squares fitted (Levenberg-Marquardt) with a Gaussian or pseudo-Voigt profile over
+	the points around its apex, peaks that don't fit fall back to the vertex of a parabola through the apex */
+
+namespace PeakFit {
+  enum class Engine { PYTHON, NATIVE, VALIDATE }; // VALIDATE runs both, answers with the python peaks and logs the differences
+  enum class Profile { GAUSSIAN, PSEUDO_VOIGT };
+
+  constexpr size_t MIN_FIT_POINTS = 5;
+  constexpr double MIN_RELATIVE_HEIGHT = 1e-3; // threshold floor as a fraction of the tallest point, for noiseless signals
+  constexpr double MAD_TO_SIGMA = 1.4826;
+  constexpr double CONVERGENCE_TOLERANCE = 1e-10;
+
+  struct Options {
+    Profile profile{ Profile::GAUSSIAN };
+    size_t baseline_window{ 101 }; // points
+    double min_snr{ 5.0 };
+    size_t max_fit_half_width{ 25 }; // points on each side of the apex
+    size_t max_iterations{ 50 };
+  };
+
+  // ---- m/z axis (mz_base) and the averaged signal on it (mz_av) ----
+  struct Spectrum {
+    ::std::vector<double> mz;
+    ::std::vector<double> intensity;
+  };
+
+  struct Peak {
+    double mz;
+    double height;
+    double fwhm;
+    double eta; // Lorentzian fraction of a pseudo-Voigt, 0 for Gaussians
+    bool fitted; // false when the parabola fallback was used
+  };
+
+  struct Noise {
+    double level; // median of the signal
+    double sigma;
+  };
+
+  struct Comparison {
+    size_t matched; // reference peaks with a peak within the tolerance
+    size_t missed;
+    size_t extra; // peaks not matched to any reference peak
+    double max_ppm; // largest difference between matched peaks
+  };
+
+  Engine parse_engine(const ::std::string &engine);
+  Profile parse_profile(const ::std::string &profile);
+  ::std::vector<double> parse_column(::std::string_view csv);
+  Spectrum make_spectrum(::std::string_view mz_csv, ::std::string_view intensity_csv);
+
+  ::std::vector<double> subtract_baseline(::std::span<const double> intensity, size_t window);
+  Noise estimate_noise(::std::span<const double> signal);
+  ::std::vector<size_t> find_local_maxima(::std::span<const double> signal, double threshold, double min_prominence, size_t max_search);
+  Peak fit_peak(::std::span<const double> mz, ::std::span<const double> signal, size_t apex, const Options &options);
+  ::std::vector<Peak> find_peaks(const Spectrum &spectrum, const Options &options);
+  Comparison compare_peaks(::std::span<const double> reference_mz, ::std::span<const double> peak_mz, double tolerance_ppm);
+};
+
+#endif
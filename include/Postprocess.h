@@ -2,9 +2,32 @@
 #define __POSTPROCESS_H
 
 #include <CNum.h>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Chem.h"
 
 namespace Postprocess {
-  void sort_preds(::CNum::DataStructs::Matrix<double> &encoded_compounds,
+  // ---- Which candidates a ranking keeps and which page of them is returned ----
+  struct RankOptions {
+    size_t top_k{ 0 }; // candidates kept per m/z, 0 keeps all of them
+    double min_score{ 0.0 }; // candidates scoring below this are dropped
+    size_t page_size{ 0 }; // ranked rows returned at once, 0 returns all of them
+    size_t offset{ 0 }; // ranked rows already returned by earlier pages
+  };
+
+  struct RankedPage {
+    ::std::vector<size_t> rows; // row numbers of the page by score (descending)
+    size_t n_ranked; // rows that passed top_k and min_score
+    size_t next_offset; // offset of the next page, n_ranked when this is the last one
+  };
+
+  RankedPage rank_preds(const ::CNum::DataStructs::Matrix<double> &preds,
+			const ::std::vector<size_t> &group_offsets,
+			const RankOptions &options);
+  void sort_preds(Chem::CompoundList &encoded_compounds,
 		  ::CNum::DataStructs::Matrix<double> &preds,
 		  ::CNum::DataStructs::Matrix<double> &ppms);
 };
@@ -4,14 +4,29 @@
 #include <CNum.h>
 #include <future>
 #include <string>
+#include <string_view>
+#include <memory>
 #include <sstream>
 #include <fstream>
 #include <mutex>
 #include <malloc.h>
 #include <span>
+#include <array>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <charconv>
+#include <exception>
+#include <filesystem>
+#include <numeric>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
 
 #include "Chem.h"
+#include "CandidateIndex.h"
+#include "FileUtils.h"
+#include "ComboFile.h"
 
 namespace Preprocess {
   struct PeakListData {
@@ -19,15 +34,52 @@ namespace Preprocess {
     ::std::vector< Chem::unenc_compound > compound_strings;
   };
   
+  // ---- Peaks of one reagent ion, lines and headers are only kept for writing them back out ----
+  struct IonPeakList {
+    PeakListData peaks;
+    Chem::CompoundList encoded_unsimplified;
+    ::std::vector< ::std::string > lines;
+    ::std::string headers;
+  };
+  
   struct CompoundPermutations {
-    ::CNum::DataStructs::Matrix<double> compounds;
+    Chem::CompoundList compounds;
     std::vector<double> masses;
   };
   
   struct MSData {
     ::CNum::DataStructs::Matrix<double> model_data;
-    ::CNum::DataStructs::Matrix<double> encoded_compounds;
+    Chem::CompoundList encoded_compounds;
+    ::CNum::DataStructs::Matrix<double> ppms;
+    ::std::vector<double> theoretical_masses;
+  };
+
+  struct MSBatchData {
+    ::CNum::DataStructs::Matrix<double> model_data;
+    Chem::CompoundList encoded_compounds;
     ::CNum::DataStructs::Matrix<double> ppms;
+    ::std::vector<double> theoretical_masses;
+    ::std::vector<double> mz; // distinct m/z values in the order they were first requested
+    ::std::vector<size_t> row_offsets; // rows of mz[i] are [row_offsets[i], row_offsets[i + 1])
+    ::std::vector<size_t> mz_idx; // index into mz of every requested m/z value
+  };
+
+  // ---- Decoded formulas packed back to back into one character buffer ----
+  class FormulaArena {
+  private:
+    ::std::unique_ptr<char[]> _chars;
+    size_t _used{ 0 };
+    size_t _capacity{ 0 };
+    ::std::vector<size_t> _ends; // formula i is [_ends[i - 1], _ends[i])
+
+  public:
+    void reserve(size_t n_formulas, size_t n_chars);
+    void clear();
+    size_t size() const;
+    ::std::string_view operator[](size_t i) const;
+
+    char *begin_formula(size_t max_len);
+    void end_formula(size_t len);
   };
 
   struct Bias {
@@ -35,26 +87,48 @@ namespace Preprocess {
     size_t zeros;
   };
 
+  struct WorkerStats {
+    size_t n_chunks;
+    size_t n_peaks;
+    double busy_seconds;
+  };
+
   ::CNum::Model::Tree::SubsampleFunction get_subsample_func(::std::vector<size_t> &ones_indeces,
 							    ::std::unordered_set<size_t> &ones_indeces_set);
   
-  ::CNum::DataStructs::Matrix<double> encode_compounds(const std::vector< Chem::unenc_compound > &compound_strings);
-  CompoundPermutations all_possible_elemental_combo(double mass, Chem::unenc_compound reagant_ion);
-  std::vector< Chem::unenc_compound > decode_compounds(const ::CNum::DataStructs::Matrix<double> &encoded_compounds);
-  ::CNum::DataStructs::Matrix<double> simplify_compounds(const ::CNum::DataStructs::Matrix<double> &unsimplified_compounds);
-  MSData mz_to_data(double mz, Chem::unenc_compound reagant_ion, size_t n_features = 18);
+  constexpr size_t MIN_ENCODE_CHUNK_SIZE = 1 << 14; // formulas per thread before encode_compounds goes parallel
+
+  Chem::Compound encode_compound(::std::string_view formula);
+  Chem::Compound encode_compound(const Chem::unenc_compound &compound_string);
+  Chem::CompoundList encode_compounds(const std::vector< Chem::unenc_compound > &compound_strings);
+  CompoundPermutations all_possible_elemental_combo(double mass, Chem::ReagantIon reagant_ion);
+  constexpr size_t MAX_FORMULA_LEN = 160; // longest decoded formula in characters
+
+  std::vector< Chem::unenc_compound > decode_compounds(const Chem::CompoundList &encoded_compounds);
+  void decode_compounds(::std::span<const Chem::Compound> encoded_compounds,
+			FormulaArena *decoded,
+			FormulaArena *decoded_simplified = nullptr);
+  Chem::CompoundList simplify_compounds(const Chem::CompoundList &unsimplified_compounds);
+  MSData mz_to_data(double mz, Chem::ReagantIon reagant_ion, size_t n_features = 18);
+  MSBatchData mz_to_data_batch(::std::span<const double> mz_values, Chem::ReagantIon reagant_ion, size_t n_features = 18);
   Bias check_bias(::CNum::DataStructs::Matrix<double> &row_matrix);
 
   namespace PrepareDataset {
+    constexpr size_t COMBO_CHUNK_SIZE = 16; // max peaks per unit of work in create_combo_file
+    constexpr size_t COMBO_CHUNKS_PER_THREAD = 32; // chunks are cut to about total cost / (threads * this)
+    constexpr size_t MAX_COMBO_ROW_LEN = 512; // longest csv row in bytes
+
     void split_by_reagant_ion(::std::string combos_path, ::std::string output_path);
     PeakListData parse_peak_list(::std::string path);
     Bias create_combo_file(::std::string output_path,
 			   ::std::string unidentified_combos_path,
-			   ::Chem::unenc_compound reagant_ion,
+			   ::Chem::ReagantIon reagant_ion, // NONE finds the ion of each peak
 			   const PeakListData &peak_list_data,
-			   const ::CNum::DataStructs::Matrix<double> &encoded_unsimplified,
-			   const ::CNum::DataStructs::Matrix<double> &encoded_simplified,
-			   int n_threads = 10);
+			   const Chem::CompoundList &encoded_unsimplified,
+			   const Chem::CompoundList &encoded_simplified,
+			   int n_threads = 10,
+			   ::ComboFile::Format format = ::ComboFile::Format::CSV,
+			   ::std::vector<WorkerStats> *worker_stats = nullptr);
     void negative_sample_reduction(::std::string path);
     void train_test_split(::std::string combo_file_path,
 			  ::std::string output_path,
@@ -63,6 +137,13 @@ namespace Preprocess {
     void peak_list_train_test_split(::std::string peak_list_path,
 				    ::std::string output_path,
 				    double test_percentage = 0.1);
+    ::std::array< ::std::vector<size_t>, 2 > shuffle_split(size_t n_peaks, double test_percentage = 0.1);
+    ::std::map< ::Chem::ReagantIon, IonPeakList > parse_peak_list_by_reagant_ion(::std::string peak_list_path, bool keep_lines = false);
+    IonPeakList gather_peaks(const IonPeakList &peak_list, const ::std::vector<size_t> &idx);
+    void write_peak_list(::std::string path,
+			 const IonPeakList &peak_list,
+			 const ::std::vector<size_t> &idx,
+			 bool write_headers);
   };
 };
 
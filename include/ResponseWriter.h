@@ -0,0 +1,69 @@
+#ifndef __RESPONSE_WRITER_H
+#define __RESPONSE_WRITER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "Preprocess.h"
+
+/* Ranked candidates written straight into one reserved buffer, without building a JSON DOM first
+
+   JSON: { "scores": [...], "compounds": [...], "uCompounds": [...], "ppms": [...],
+	   "critereaEncodings": [[c0, c1, c2, c3], ...], "totalCandidates": n, "nextCursor": "..." }
+   with one entry per returned candidate, nextCursor is only there when more candidates are left
+
+   Binary (native byte order):
+     Header
+     columns, each one a uint32 byte length followed by its bytes
+       scores:            n_rows float32
+       ppms:              n_rows float32
+       criterea:          n_rows uint8, bit k is criterea k
+       compounds:         string table
+       uCompounds:        string table
+       nextCursor:        characters, empty on the last page
+   A string table is n_rows + 1 uint32 offsets followed by the characters, string i is [offsets[i], offsets[i + 1]) */
+
+namespace ResponseWriter {
+  enum class Format { JSON, BINARY };
+
+  constexpr char MAGIC[8] = { 'S', 'O', 'A', 'R', 'R', 'E', 'S', '\0' };
+  constexpr uint32_t VERSION = 1;
+  constexpr ::std::string_view JSON_CONTENT_TYPE = "application/json";
+  constexpr ::std::string_view BINARY_CONTENT_TYPE = "application/octet-stream";
+  constexpr size_t MAX_NUMBER_LEN = 32; // longest number written by to_chars, with room for the separator
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_rows;
+    uint64_t total_candidates;
+  };
+  static_assert(sizeof(Header) == 24);
+
+  // ---- One page of ranked candidates, row i of every column is the same candidate ----
+  struct Response {
+    ::std::vector<double> scores; // percentages
+    ::std::vector<double> ppms;
+    ::std::vector<uint8_t> crit_bits;
+    ::Preprocess::FormulaArena compounds; // simplified
+    ::Preprocess::FormulaArena u_compounds;
+    size_t total_candidates{ 0 };
+    ::std::string next_cursor; // empty on the last page
+
+    size_t size() const;
+  };
+
+  Format negotiate_format(::std::string_view accept);
+  ::std::string_view get_content_type(Format format);
+  void write_json(const Response &response, ::std::string &out);
+  void write_binary(const Response &response, ::std::string &out);
+  void write(Format format, const Response &response, ::std::string &out);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __RESULT_CACHE_H
+#define __RESULT_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <unordered_map>
+
+#include "Chem.h"
+
+namespace ResultCache {
+  struct Key {
+    ::Chem::ReagantIon reagant_ion;
+    int64_t mz_bucket;
+
+    bool operator==(const Key &other) const = default;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  // ---- Candidates of one m/z sorted by score (descending) ----
+  struct Entry {
+    ::Chem::CompoundList encoded_compounds; // unsimplified
+    ::std::vector<double> theoretical_masses;
+    ::std::vector<double> scores;
+  };
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t candidates;
+  };
+
+  // ---- Thread safe LRU cache of m/z -> candidate results, split into independently locked shards ----
+  class ShardedLRU {
+  private:
+    struct Shard {
+      ::std::mutex mtx;
+      ::std::list< ::std::pair<Key, ::std::shared_ptr<const Entry> > > lru; // most recently used first
+      ::std::unordered_map<Key, decltype(lru)::iterator, KeyHash> lookup;
+      size_t candidates{ 0 };
+    };
+
+    ::std::vector< ::std::unique_ptr<Shard> > _shards;
+    size_t _shard_capacity; // candidates per shard
+    double _mz_resolution;
+
+    ::std::atomic<uint64_t> _hits{ 0 };
+    ::std::atomic<uint64_t> _misses{ 0 };
+    ::std::atomic<uint64_t> _evictions{ 0 };
+
+    Shard &get_shard(const Key &key);
+
+  public:
+    ShardedLRU(size_t max_candidates, size_t n_shards, double mz_resolution);
+
+    Key make_key(::Chem::ReagantIon reagant_ion, double mz) const;
+    ::std::shared_ptr<const Entry> get(const Key &key);
+    void put(const Key &key, ::std::shared_ptr<const Entry> entry);
+    Stats get_stats();
+  };
+};
+
+#endif
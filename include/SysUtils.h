@@ -2,11 +2,59 @@
 #define __SYS_UTILS_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include <stdexcept>
-#include "InferenceAPI.h"
+#include <sys/types.h>
 
 void execute_peak_fit_bin(::std::string mz_b,
 			  ::std::string mz_av,
-			  ::std::string output_path);
+			  ::std::string output_path,
+			  const ::std::vector<int> &inherit_fds = {}); // close on exec fds the tool opens by path
+
+/* Worker protocol over the worker's stdin/stdout, all integers little endian uint32
+     request:  length of the mz_base csv, its bytes, length of the mz_av csv, its bytes
+     response: number of peaks n followed by n float64 m/z values, or
+	       WORKER_ERROR followed by the length of an error message and its bytes */
+
+constexpr uint32_t WORKER_ERROR = 0xFFFFFFFF;
+constexpr uint32_t MAX_WORKER_PEAKS = 1 << 24;
+
+// ---- Long lived fit_peaks processes that are handed spectra one request at a time ----
+class PeakFitWorkerPool {
+private:
+  struct Worker {
+    pid_t pid{ -1 };
+    int to_worker{ -1 }; // worker's stdin
+    int from_worker{ -1 }; // worker's stdout
+  };
+
+  ::std::vector<char *> _argv; // NULL terminated
+  ::std::vector<::std::string> _args;
+  ::std::chrono::milliseconds _timeout;
+  ::std::vector<Worker> _workers;
+  ::std::vector<size_t> _idle;
+  ::std::mutex _mtx;
+  ::std::condition_variable _cv;
+
+  void spawn(Worker &worker);
+  void kill(Worker &worker);
+  size_t acquire();
+  void release(size_t idx);
+
+public:
+  PeakFitWorkerPool(const ::std::string &executable,
+		    const ::std::vector<::std::string> &args,
+		    size_t n_workers,
+		    ::std::chrono::milliseconds timeout);
+  ~PeakFitWorkerPool();
+  PeakFitWorkerPool(const PeakFitWorkerPool &) = delete;
+  PeakFitWorkerPool &operator=(const PeakFitWorkerPool &) = delete;
+
+  ::std::vector<double> fit(::std::string_view mz_base, ::std::string_view mz_av);
+};
   
 #endif
@@ -0,0 +1,164 @@
+#include "CandidateIndex.h"
+
+using namespace Chem;
+
+namespace CandidateIndex {
+  // ---------------------
+  // Formula Mass Index
+  // ---------------------
+
+  // ---- Recursive function for collecting every combo of the mask elements lighter than the mass limit ----
+  static void enumerate_combos(::std::vector<double> &masses,
+			       ::std::vector<uint16_t> &counts,
+			       ::std::vector<uint16_t> &temp,
+			       const ::std::array<double, TOTAL_CHEMS> &chem_masses,
+			       const ::std::vector<uint8_t> &elements,
+			       double partial_mass,
+			       double mass_limit,
+			       size_t pos = 0) {
+    if (pos == elements.size()) {
+      // skip the empty compound
+      if (partial_mass > 0.0) {
+	masses.push_back(partial_mass);
+	counts.insert(counts.end(), temp.begin(), temp.end());
+      }
+      return;
+    }
+
+    double el_mass = chem_masses[elements[pos]];
+    for (uint16_t n{}; n * el_mass <= mass_limit - partial_mass; n++) {
+      temp[pos] = n;
+      // Sum in element order so the masses match Chem::get_compound_mass exactly
+      enumerate_combos(masses,
+		       counts,
+		       temp,
+		       chem_masses,
+		       elements,
+		       n == 0 ? partial_mass : partial_mass + el_mass * n,
+		       mass_limit,
+		       pos + 1);
+    }
+    temp[pos] = 0;
+  }
+
+  // ---- Constructor ----
+  MassIndex::MassIndex(const ReagantIonMask &mask, double max_mz)
+    : _elements(mask.indeces.begin(), mask.indeces.begin() + mask.length),
+      _stride(mask.length),
+      _max_mz(max_mz) {
+    auto *cm = ChemMap::get_chem_map();
+    const auto &chem_masses = cm->get_masses();
+
+    // Heaviest formula that can still fall within the ppm window of max_mz
+    double mass_limit = max_mz / (1 - PPM_TOLERANCE * 1e-6);
+
+    ::std::vector<double> masses;
+    ::std::vector<uint16_t> counts;
+    ::std::vector<uint16_t> temp(_stride, 0);
+    enumerate_combos(masses, counts, temp, chem_masses, _elements, 0.0, mass_limit);
+
+    ::std::vector<size_t> order(masses.size());
+    ::std::iota(order.begin(), order.end(), 0);
+    ::std::sort(order.begin(), order.end(), [&masses] (size_t a, size_t b) { return masses[a] < masses[b]; });
+
+    _masses.reserve(masses.size());
+    _counts.reserve(counts.size());
+    for (auto entry: order) {
+      _masses.push_back(masses[entry]);
+      _counts.insert(_counts.end(), counts.begin() + entry * _stride, counts.begin() + (entry + 1) * _stride);
+    }
+  }
+
+  // ---- Check if the index holds every candidate of an m/z ----
+  bool MassIndex::covers(double mz) const {
+    return mz > 0.0 && mz <= _max_mz;
+  }
+
+  size_t MassIndex::size() const {
+    return _masses.size();
+  }
+
+  double MassIndex::get_max_mz() const {
+    return _max_mz;
+  }
+
+  double MassIndex::get_mass(size_t entry) const {
+    return _masses[entry];
+  }
+
+  // ---- Get the element counts of an entry (ordered like get_elements) ----
+  ::std::span<const uint16_t> MassIndex::get_counts(size_t entry) const {
+    return { _counts.data() + entry * _stride, _stride };
+  }
+
+  const ::std::vector<uint8_t> &MassIndex::get_elements() const {
+    return _elements;
+  }
+
+  // ---- Find all entries within the ppm tolerance of an m/z ----
+  void MassIndex::query(double mz, ::std::vector<size_t> &hits) const {
+    hits.clear();
+
+    // |ppm| <= tol  <=>  mz / (1 + tol) <= theoretical <= mz / (1 - tol), padded for rounding
+    double low = mz / (1 + PPM_TOLERANCE * 1e-6) * (1 - 1e-12);
+    double high = mz / (1 - PPM_TOLERANCE * 1e-6) * (1 + 1e-12);
+
+    size_t first = ::std::lower_bound(_masses.begin(), _masses.end(), low) - _masses.begin();
+    size_t last = ::std::upper_bound(_masses.begin() + first, _masses.end(), high) - _masses.begin();
+
+    // Exact ppm check of the window in blocks, so nothing is allocated
+    constexpr size_t block_size = 64;
+    ::std::array<double, block_size> ppms;
+    for (size_t start = first; start < last; start += block_size) {
+      size_t n = ::std::min(block_size, last - start);
+      Chem::get_ppms(mz, ::std::span<const double>(_masses.data() + start, n), ppms.data());
+      for (size_t i{}; i < n; i++) {
+	if (::std::abs(ppms[i]) <= PPM_TOLERANCE)
+	  hits.push_back(start + i);
+      }
+    }
+
+    /* enumerate_elemental_combos visits combos in lexicographic order of their (sorted) element sequence,
+       which is descending order of the element counts. Keep that order so results don't depend on
+       whether the index was used */
+    ::std::sort(hits.begin(), hits.end(), [this] (size_t a, size_t b) {
+      auto counts_a = get_counts(a);
+      auto counts_b = get_counts(b);
+      return ::std::lexicographical_compare(counts_b.begin(), counts_b.end(),
+					    counts_a.begin(), counts_a.end());
+    });
+  }
+
+  // ---------------------
+  // Index Registry
+  // ---------------------
+
+  // One slot per reagent ion, indexed by the ion id
+  static ::std::array<::std::optional<MassIndex>, N_REAGANT_IONS> &get_registry() {
+    static auto *registry = new ::std::array<::std::optional<MassIndex>, N_REAGANT_IONS>(); // Leak by design to avoid shutdown order issues
+    return *registry;
+  }
+
+  // ---- Build the index of a reagent ion (not thread safe, build before any lookups are made) ----
+  void build(ReagantIon reagant_ion, double max_mz) {
+    auto *cm = ChemMap::get_chem_map();
+    const auto &mask = cm->get_reagant_ion_mask(reagant_ion);
+
+    auto &slot = get_registry()[static_cast<size_t>(reagant_ion)];
+    slot.reset();
+
+    if (max_mz <= 0.0)
+      return;
+
+    slot.emplace(mask, max_mz);
+  }
+
+  // ---- Get the index of a reagent ion, nullptr if one was never built ----
+  const MassIndex *get_index(ReagantIon reagant_ion) {
+    if (reagant_ion == ReagantIon::NONE)
+      return nullptr;
+
+    auto &slot = get_registry()[static_cast<size_t>(reagant_ion)];
+    return slot.has_value() ? &*slot : nullptr;
+  }
+}
@@ -0,0 +1,193 @@
+#include "Chem.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOAR_X86_KERNELS
+#endif
+
+/* Batch versions of the per compound Chem utilities. Every kernel has a scalar path that gives the
+   same results, the AVX2 paths are compiled with a target attribute and picked at runtime so the
+   binaries still run on CPUs without AVX2 */
+
+namespace Chem {
+  // ---------------------
+  // CPU Dispatch
+  // ---------------------
+
+  static bool has_avx2() {
+#ifdef SOAR_X86_KERNELS
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#else
+    return false;
+#endif
+  }
+
+  // ---------------------
+  // Criterea
+  // ---------------------
+
+  static void check_criterea_scalar(const CritereaCounts &counts, size_t start, size_t n, uint8_t *out_bits) {
+    for (size_t i = start; i < n; i++)
+      out_bits[i] = criterea_bits_of(counts.hydrogen[i], counts.carbon[i], counts.nitrogen[i], counts.nh4[i], counts.nh3[i]);
+  }
+
+#ifdef SOAR_X86_KERNELS
+  // ---- Lanes where a > b as unsigned 16 bit integers ----
+  __attribute__((target("avx2")))
+  static inline __m256i cmpgt_epu16(__m256i a, __m256i b) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(a, b), _mm256_setzero_si256()),
+			    _mm256_set1_epi16(-1));
+  }
+
+  __attribute__((target("avx2")))
+  static inline __m256i load_counts(const uint16_t *counts) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts));
+  }
+
+  // ---- 16 candidates per iteration, returns how many were done ----
+  __attribute__((target("avx2")))
+  static size_t check_criterea_avx2(const CritereaCounts &counts, size_t n, uint8_t *out_bits) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i two = _mm256_set1_epi16(2);
+    const __m256i all_passed = _mm256_set1_epi16(CRITEREA_ALL_PASSED);
+
+    size_t i{};
+    for (; i + 16 <= n; i += 16) {
+      __m256i hydrogen = load_counts(counts.hydrogen + i);
+      __m256i carbon = load_counts(counts.carbon + i);
+      __m256i no_nitrogen = _mm256_cmpeq_epi16(load_counts(counts.nitrogen + i), zero);
+      __m256i no_nh4 = _mm256_cmpeq_epi16(load_counts(counts.nh4 + i), zero);
+      __m256i no_nh3 = _mm256_cmpeq_epi16(load_counts(counts.nh3 + i), zero);
+
+      __m256i h_odd = _mm256_and_si256(hydrogen, one);
+      // Saturating adds keep the bounds exact, a saturated bound can't be exceeded by a 16 bit count
+      __m256i bound_nh4 = _mm256_adds_epu16(_mm256_adds_epu16(carbon, carbon), two);
+      __m256i bound_no_n = _mm256_adds_epu16(bound_nh4, one);
+
+      // Each failed criterea clears its bit, lanes are 0 or all ones before the and
+      __m256i no_n_at_all = _mm256_and_si256(no_nitrogen, _mm256_and_si256(no_nh4, no_nh3));
+      __m256i fails = _mm256_andnot_si256(no_nh4, _mm256_or_si256(h_odd,
+								   _mm256_and_si256(cmpgt_epu16(hydrogen, bound_nh4), two)));
+      fails = _mm256_or_si256(fails, _mm256_and_si256(no_n_at_all,
+						       _mm256_or_si256(_mm256_slli_epi16(_mm256_xor_si256(h_odd, one), 2),
+								       _mm256_and_si256(cmpgt_epu16(hydrogen, bound_no_n),
+											_mm256_set1_epi16(8)))));
+      __m256i bits = _mm256_andnot_si256(fails, all_passed);
+
+      __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out_bits + i), packed);
+    }
+
+    return i;
+  }
+#endif
+
+  // ---- Check the 4 criterea of n candidates, out_bits[i] gets the criterea bits of candidate i ----
+  void check_criterea_batch(const CritereaCounts &counts, size_t n, uint8_t *out_bits) {
+    size_t done{};
+#ifdef SOAR_X86_KERNELS
+    if (has_avx2())
+      done = check_criterea_avx2(counts, n, out_bits);
+#endif
+
+    check_criterea_scalar(counts, done, n, out_bits);
+  }
+
+  // ---- Criterea bits of packed compounds, gathered into structure of arrays blocks for the kernel ----
+  void get_criterea_bits_batch(::std::span<const Compound> compounds, uint8_t *out_bits) {
+    constexpr size_t block_size = 256;
+    ::std::array<::std::array<uint16_t, block_size>, 5> block;
+    CritereaCounts counts{ block[0].data(), block[1].data(), block[2].data(), block[3].data(), block[4].data() };
+
+    for (size_t start{}; start < compounds.size(); start += block_size) {
+      size_t n = ::std::min(block_size, compounds.size() - start);
+      for (size_t i{}; i < n; i++) {
+	const auto &compound = compounds[start + i];
+	block[0][i] = compound[ChemIdx::H];
+	block[1][i] = compound[ChemIdx::C];
+	block[2][i] = compound[ChemIdx::N];
+	block[3][i] = compound[ChemIdx::NH4];
+	block[4][i] = compound[ChemIdx::NH3];
+      }
+
+      check_criterea_batch(counts, n, out_bits + start);
+    }
+  }
+
+  // ---------------------
+  // Masses and ppm
+  // ---------------------
+
+  /* Lanes are candidates, not elements, so every lane adds its terms in the same order as
+     get_compound_mass. The AVX2 target doesn't include FMA, so the multiplies and adds round
+     exactly like the scalar code */
+
+#ifdef SOAR_X86_KERNELS
+  // ---- 4 candidates per iteration, returns how many were done ----
+  __attribute__((target("avx2")))
+  static size_t get_compound_masses_avx2(::std::span<const Compound> compounds, double *out_masses) {
+    // Offsets of 4 consecutive compounds in units of the 4 byte gather scale
+    const __m128i compound_offsets = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i gather_idx = _mm_mullo_epi32(compound_offsets, _mm_set1_epi32(sizeof(Compound) / 4));
+    const __m128i low_half = _mm_set1_epi32(0xFFFF);
+
+    size_t i{};
+    for (; i + 4 <= compounds.size(); i += 4) {
+      const uint16_t *counts_base = compounds[i].counts.data();
+      __m256d total_mass = _mm256_setzero_pd();
+
+      for (size_t k{}; k < TOTAL_CHEMS; k++) {
+	// 32 bit gather at count k of each compound, the upper half (count k + 1) is masked off
+	__m128i counts = _mm_i32gather_epi32(reinterpret_cast<const int *>(counts_base + k), gather_idx, 4);
+	__m256d term = _mm256_mul_pd(_mm256_set1_pd(CHEM_MASSES[k]), _mm256_cvtepi32_pd(_mm_and_si128(counts, low_half)));
+	total_mass = _mm256_add_pd(total_mass, term);
+      }
+
+      _mm256_storeu_pd(out_masses + i, total_mass);
+    }
+
+    return i;
+  }
+
+  __attribute__((target("avx2")))
+  static size_t get_ppms_avx2(double observed_mz, ::std::span<const double> theoretical_mzs, double *out_ppms) {
+    const __m256d observed = _mm256_set1_pd(observed_mz);
+    const __m256d normalization = _mm256_set1_pd(PPM_NORMALIZATION_FACTOR);
+
+    size_t i{};
+    for (; i + 4 <= theoretical_mzs.size(); i += 4) {
+      __m256d theoretical = _mm256_loadu_pd(theoretical_mzs.data() + i);
+      __m256d ppm = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(observed, theoretical), theoretical), normalization);
+      _mm256_storeu_pd(out_ppms + i, ppm);
+    }
+
+    return i;
+  }
+#endif
+
+  // ---- Theoretical mass of every compound, identical to get_compound_mass ----
+  void get_compound_masses(::std::span<const Compound> compounds, double *out_masses) {
+    size_t done{};
+#ifdef SOAR_X86_KERNELS
+    if (has_avx2())
+      done = get_compound_masses_avx2(compounds, out_masses);
+#endif
+
+    for (size_t i = done; i < compounds.size(); i++)
+      out_masses[i] = get_compound_mass(compounds[i]);
+  }
+
+  // ---- ppm of an observed m/z against every theoretical m/z, identical to get_ppm ----
+  void get_ppms(double observed_mz, ::std::span<const double> theoretical_mzs, double *out_ppms) {
+    size_t done{};
+#ifdef SOAR_X86_KERNELS
+    if (has_avx2())
+      done = get_ppms_avx2(observed_mz, theoretical_mzs, out_ppms);
+#endif
+
+    for (size_t i = done; i < theoretical_mzs.size(); i++)
+      out_ppms[i] = get_ppm(observed_mz, theoretical_mzs[i]);
+  }
+}
@@ -0,0 +1,206 @@
+#include "ComboFile.h"
+
+using namespace CNum::DataStructs;
+
+namespace ComboFile {
+  // ------------------
+  // Rows
+  // ------------------
+
+  void Rows::push_back(uint8_t crit_bits, const ::Chem::Compound &compound, double ppm, bool label) {
+    crit_masks.push_back(crit_bits);
+    compounds.push_back(compound);
+    ppms.push_back(ppm);
+    labels.push_back(label);
+  }
+
+  void Rows::append(const Rows &other) {
+    crit_masks.insert(crit_masks.end(), other.crit_masks.begin(), other.crit_masks.end());
+    compounds.insert(compounds.end(), other.compounds.begin(), other.compounds.end());
+    ppms.insert(ppms.end(), other.ppms.begin(), other.ppms.end());
+    labels.insert(labels.end(), other.labels.begin(), other.labels.end());
+  }
+
+  void Rows::clear() {
+    crit_masks.clear();
+    compounds.clear();
+    ppms.clear();
+    labels.clear();
+  }
+
+  size_t Rows::size() const {
+    return ppms.size();
+  }
+
+  // ------------------
+  // Format
+  // ------------------
+
+  Format parse_format(const ::std::string &format) {
+    if (format == "csv")
+      return Format::CSV;
+
+    if (format == "binary")
+      return Format::BINARY;
+
+    throw ::std::invalid_argument("Combo file error -- unknown combo file format " + format + " (csv|binary)");
+  }
+
+  ::std::string get_extension(Format format) {
+    return format == Format::BINARY ? ".bin" : ".csv";
+  }
+
+  static constexpr size_t align_column(size_t n_bytes) {
+    return (n_bytes + 7) & ~static_cast<size_t>(7);
+  }
+
+  static size_t column_bytes(ColumnType type, size_t n_rows) {
+    switch (type) {
+    case ColumnType::BIT:
+      return align_column((n_rows + 7) / 8);
+    case ColumnType::UINT16:
+      return align_column(n_rows * sizeof(uint16_t));
+    case ColumnType::FLOAT64:
+      return align_column(n_rows * sizeof(double));
+    }
+
+    throw ::std::runtime_error("Combo file error -- unknown column type");
+  }
+
+  static ::std::array<ColumnType, N_COLUMNS> get_column_types() {
+    ::std::array<ColumnType, N_COLUMNS> types;
+    size_t col{};
+    for (size_t k{}; k < ::Chem::N_CRITEREA; k++)
+      types[col++] = ColumnType::BIT;
+
+    for (size_t k{}; k < ::Chem::TOTAL_CHEMS; k++)
+      types[col++] = ColumnType::UINT16;
+
+    types[col++] = ColumnType::FLOAT64;
+    types[col++] = ColumnType::BIT;
+    return types;
+  }
+
+  // ------------------
+  // Writing
+  // ------------------
+
+  // ---- Write one column, get_value(i) gives the value of row i ----
+  template <typename T, typename F>
+  static void write_column(::std::ofstream &os, size_t n_rows, F get_value) {
+    ::std::vector<T> column(align_column(n_rows * sizeof(T)) / sizeof(T), 0);
+    for (size_t i{}; i < n_rows; i++)
+      column[i] = get_value(i);
+
+    os.write(reinterpret_cast<const char *>(column.data()), column.size() * sizeof(T));
+  }
+
+  template <typename F>
+  static void write_bit_column(::std::ofstream &os, size_t n_rows, F get_bit) {
+    ::std::vector<uint8_t> column(column_bytes(ColumnType::BIT, n_rows), 0);
+    for (size_t i{}; i < n_rows; i++)
+      column[i / 8] |= static_cast<uint8_t>(get_bit(i) << (i % 8));
+
+    os.write(reinterpret_cast<const char *>(column.data()), column.size());
+  }
+
+  // ---- Write rows to a binary combo file ----
+  void write(const ::std::string &path, ::Chem::ReagantIon reagant_ion, const Rows &rows) {
+    ::std::ofstream os(path, ::std::ios::binary);
+    if (!os.is_open())
+      throw ::std::runtime_error("Combo file error -- couldn't open " + path);
+
+    auto &ion_name = ::Chem::ChemMap::get_chem_map()->get_reagant_ion_name(reagant_ion);
+    if (ion_name.size() >= sizeof(Header::reagant_ion))
+      throw ::std::invalid_argument("Combo file error -- reagant ion name " + ion_name + " is too long");
+
+    size_t n_rows = rows.size();
+
+    Header header{};
+    ::std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.n_features = N_FEATURES;
+    header.n_rows = n_rows;
+    ::std::memcpy(header.reagant_ion, ion_name.data(), ion_name.size());
+    auto types = get_column_types();
+    ::std::copy(types.begin(), types.end(), header.column_types);
+    os.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+
+    for (size_t k{}; k < ::Chem::N_CRITEREA; k++)
+      write_bit_column(os, n_rows, [&rows, k] (size_t i) { return (rows.crit_masks[i] >> k) & 1; });
+
+    for (size_t k{}; k < ::Chem::TOTAL_CHEMS; k++)
+      write_column<uint16_t>(os, n_rows, [&rows, k] (size_t i) { return rows.compounds[i][k]; });
+
+    write_column<double>(os, n_rows, [&rows] (size_t i) { return rows.ppms[i]; });
+    write_bit_column(os, n_rows, [&rows] (size_t i) { return rows.labels[i]; });
+
+    if (!os.good())
+      throw ::std::runtime_error("Combo file error -- writing " + path + " failed");
+  }
+
+  // ------------------
+  // Loading
+  // ------------------
+
+  // ---- Map a binary combo file and decode its columns straight into the (X, y) training matrices ----
+  ::std::array<Matrix<double>, 2> load(const ::std::string &path) {
+    ::FileUtils::MappedFile file(path);
+    auto bytes = file.view();
+
+    if (bytes.size() < sizeof(Header))
+      throw ::std::runtime_error("Combo file error -- " + path + " is too small to be a combo file");
+
+    Header header;
+    ::std::memcpy(&header, bytes.data(), sizeof(Header));
+
+    if (::std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+      throw ::std::runtime_error("Combo file error -- " + path + " is not a binary combo file");
+
+    if (header.version != VERSION)
+      throw ::std::runtime_error("Combo file error -- unsupported combo file version " + ::std::to_string(header.version));
+
+    auto types = get_column_types();
+    if (header.n_features != N_FEATURES || !::std::equal(types.begin(), types.end(), header.column_types))
+      throw ::std::runtime_error("Combo file error -- column layout of " + path + " doesn't match this build");
+
+    size_t n_rows = header.n_rows;
+    size_t expected_size = sizeof(Header);
+    for (auto type: types)
+      expected_size += column_bytes(type, n_rows);
+
+    if (bytes.size() != expected_size)
+      throw ::std::runtime_error("Combo file error -- " + path + " is truncated");
+
+    auto x = ::std::make_unique<double[]>(n_rows * N_FEATURES);
+    auto y = ::std::make_unique<double[]>(n_rows);
+
+    const char *column = bytes.data() + sizeof(Header);
+    for (size_t col{}; col < N_COLUMNS; col++) {
+      double *out = col < N_FEATURES ? x.get() + col : y.get();
+      size_t stride = col < N_FEATURES ? N_FEATURES : 1;
+
+      switch (types[col]) {
+      case ColumnType::BIT:
+	for (size_t i{}; i < n_rows; i++)
+	  out[i * stride] = (column[i / 8] >> (i % 8)) & 1;
+	break;
+      case ColumnType::UINT16:
+	for (size_t i{}; i < n_rows; i++) {
+	  uint16_t count;
+	  ::std::memcpy(&count, column + i * sizeof(uint16_t), sizeof(uint16_t));
+	  out[i * stride] = ::Chem::count_to_feature(count);
+	}
+	break;
+      case ColumnType::FLOAT64:
+	for (size_t i{}; i < n_rows; i++)
+	  ::std::memcpy(out + i * stride, column + i * sizeof(double), sizeof(double));
+	break;
+      }
+
+      column += column_bytes(types[col], n_rows);
+    }
+
+    return { Matrix<double>(n_rows, N_FEATURES, ::std::move(x)), Matrix<double>(n_rows, 1, ::std::move(y)) };
+  }
+}
@@ -0,0 +1,311 @@
+#include "FileUtils.h"
+
+namespace FileUtils {
+  // ------------------
+  // Memory Mapping
+  // ------------------
+
+  // ---- Constructor ----
+  MappedFile::MappedFile(const ::std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      throw ::std::runtime_error("Mapped file error -- couldn't open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      close(fd);
+      throw ::std::runtime_error("Mapped file error -- couldn't stat " + path);
+    }
+
+    _size = static_cast<size_t>(st.st_size);
+
+    // mmap doesn't allow empty mappings, an empty file is just an empty view
+    if (_size > 0) {
+      void *data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+	close(fd);
+	throw ::std::runtime_error("Mapped file error -- couldn't map " + path);
+      }
+
+      madvise(data, _size, MADV_SEQUENTIAL);
+      _data = static_cast<const char *>(data);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+  }
+
+  // ---- Destructor ----
+  MappedFile::~MappedFile() {
+    if (_data != nullptr)
+      munmap(const_cast<char *>(_data), _size);
+  }
+
+  // ---- Move Constructor ----
+  MappedFile::MappedFile(MappedFile &&other) noexcept
+    : _data(other._data),
+      _size(other._size) {
+    other._data = nullptr;
+    other._size = 0;
+  }
+
+  // ---- Move Assignment ----
+  MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+      if (_data != nullptr)
+	munmap(const_cast<char *>(_data), _size);
+
+      _data = other._data;
+      _size = other._size;
+      other._data = nullptr;
+      other._size = 0;
+    }
+
+    return *this;
+  }
+
+  ::std::string_view MappedFile::view() const {
+    return { _data, _size };
+  }
+
+  size_t MappedFile::size() const {
+    return _size;
+  }
+
+  // ------------------
+  // Block Writing
+  // ------------------
+
+  // ---- Constructor ----
+  BlockWriter::BlockWriter(const ::std::string &path)
+    : _path(path),
+      _buffer(::std::make_unique<char[]>(WRITE_BLOCK_SIZE)) {
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd == -1)
+      throw ::std::runtime_error("Block writer error -- couldn't open " + path);
+  }
+
+  // ---- Destructor ----
+  BlockWriter::~BlockWriter() {
+    try {
+      flush();
+    } catch (...) {}
+
+    ::close(_fd);
+  }
+
+  // ---- Copy bytes into the buffer, writing it out whenever it fills up ----
+  void BlockWriter::append(const char *data, size_t n_bytes) {
+    _size += n_bytes;
+    while (n_bytes > 0) {
+      size_t n_copied = ::std::min(n_bytes, WRITE_BLOCK_SIZE - _used);
+      ::std::memcpy(_buffer.get() + _used, data, n_copied);
+      _used += n_copied;
+      data += n_copied;
+      n_bytes -= n_copied;
+
+      if (_used == WRITE_BLOCK_SIZE)
+	flush();
+    }
+  }
+
+  void BlockWriter::flush() {
+    size_t written{};
+    while (written < _used) {
+      auto res = ::write(_fd, _buffer.get() + written, _used - written);
+      if (res == -1) {
+	if (errno == EINTR)
+	  continue;
+
+	throw ::std::runtime_error("Block writer error -- writing " + _path + " failed");
+      }
+
+      written += static_cast<size_t>(res);
+    }
+
+    _used = 0;
+  }
+
+  // ---- Bytes appended so far, including the ones still in the buffer ----
+  size_t BlockWriter::size() const {
+    return _size;
+  }
+
+  const ::std::string &BlockWriter::get_path() const {
+    return _path;
+  }
+
+  // ------------------
+  // Tokenizing
+  // ------------------
+
+  // ---- Pop the next line (without the newline) off the front of the text ----
+  ::std::string_view next_line(::std::string_view &text) {
+    auto end = text.find('\n');
+    if (end == ::std::string_view::npos) {
+      auto line = text;
+      text = {};
+      return line;
+    }
+
+    auto line = text.substr(0, end);
+    text.remove_prefix(end + 1);
+    return line;
+  }
+
+  // ---- Split text into at most max_chunks pieces of whole lines ----
+  ::std::vector<::std::string_view> split_into_chunks(::std::string_view text, size_t max_chunks, size_t min_chunk_size) {
+    ::std::vector<::std::string_view> chunks;
+    if (text.empty())
+      return chunks;
+
+    size_t chunk_size = ::std::max((text.size() + max_chunks - 1) / ::std::max<size_t>(max_chunks, 1), min_chunk_size);
+    while (!text.empty()) {
+      if (text.size() <= chunk_size) {
+	chunks.push_back(text);
+	break;
+      }
+
+      // Extend each chunk to the end of the line it would have cut
+      auto end = text.find('\n', chunk_size - 1);
+      end = end == ::std::string_view::npos ? text.size() : end + 1;
+      chunks.push_back(text.substr(0, end));
+      text.remove_prefix(end);
+    }
+
+    return chunks;
+  }
+
+  // ---- Get a column of a delimited line, empty if the line is too short ----
+  ::std::string_view get_field(::std::string_view line, size_t col, char delim) {
+    for (size_t i{}; i < col; i++) {
+      auto pos = line.find(delim);
+      if (pos == ::std::string_view::npos)
+	return {};
+
+      line.remove_prefix(pos + 1);
+    }
+
+    return line.substr(0, line.find(delim));
+  }
+
+  // ---- Convert a field to a double without allocating, false if it isn't a number ----
+  bool parse_double(::std::string_view field, double &value) {
+    while (!field.empty() && ::std::isspace(static_cast<unsigned char>(field.front())))
+      field.remove_prefix(1);
+
+    if (!field.empty() && field.front() == '+')
+      field.remove_prefix(1);
+
+    auto [ptr, ec] = ::std::from_chars(field.data(), field.data() + field.size(), value);
+    return ec == ::std::errc() && ptr != field.data();
+  }
+
+  // ------------------
+  // In Memory Files
+  // ------------------
+
+  // ---- Constructor ----
+  MemFile::MemFile(const char *name) {
+    // Close on exec keeps the file out of unrelated children, execute_peak_fit_bin clears it for the tool's own fds
+    _fd = memfd_create(name, MFD_CLOEXEC);
+    if (_fd == -1)
+      throw ::std::runtime_error("Mem file error -- couldn't create " + ::std::string(name) + ": " + ::std::strerror(errno));
+  }
+
+  // ---- Destructor ----
+  MemFile::~MemFile() {
+    if (_fd != -1)
+      close(_fd);
+  }
+
+  int MemFile::fd() const {
+    return _fd;
+  }
+
+  ::std::string MemFile::child_path() const {
+    return "/proc/self/fd/" + ::std::to_string(_fd);
+  }
+
+  void MemFile::write(::std::string_view bytes) {
+    while (!bytes.empty()) {
+      ssize_t written = ::write(_fd, bytes.data(), bytes.size());
+      if (written < 0) {
+	if (errno == EINTR)
+	  continue;
+	throw ::std::runtime_error("Mem file error -- write failed: " + ::std::string(::std::strerror(errno)));
+      }
+
+      bytes.remove_prefix(written);
+    }
+  }
+
+  // ---- Whole contents no matter where the file offset is, a child may have written them through its own descriptor ----
+  ::std::string MemFile::read_all() const {
+    struct stat st;
+    if (fstat(_fd, &st) == -1)
+      throw ::std::runtime_error("Mem file error -- couldn't stat: " + ::std::string(::std::strerror(errno)));
+
+    ::std::string bytes(static_cast<size_t>(st.st_size), '\0');
+    size_t done{};
+    while (done < bytes.size()) {
+      ssize_t got = pread(_fd, bytes.data() + done, bytes.size() - done, done);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	throw ::std::runtime_error("Mem file error -- read failed");
+      done += got;
+    }
+
+    return bytes;
+  }
+
+  // ------------------
+  // Retention
+  // ------------------
+
+  // ---- Delete the oldest regular files of dir until it's within policy, returns how many were deleted ----
+  size_t enforce_retention(const ::std::string &dir, const RetentionPolicy &policy) {
+    struct Entry {
+      ::std::filesystem::path path;
+      ::std::filesystem::file_time_type mtime;
+      uintmax_t size;
+    };
+
+    // Files can disappear while the directory is read (another request enforcing the same policy), errors just skip them
+    ::std::error_code ec;
+    ::std::vector<Entry> entries;
+    for (const auto &dir_entry: ::std::filesystem::directory_iterator(dir, ec)) {
+      if (!dir_entry.is_regular_file(ec))
+	continue;
+
+      auto mtime = dir_entry.last_write_time(ec);
+      auto size = dir_entry.file_size(ec);
+      if (!ec)
+	entries.push_back({ dir_entry.path(), mtime, size });
+    }
+
+    // Newest first, so everything past the first entry that breaks a limit goes
+    ::std::sort(entries.begin(), entries.end(), [] (const Entry &a, const Entry &b) { return a.mtime > b.mtime; });
+
+    auto now = ::std::filesystem::file_time_type::clock::now();
+    size_t kept{}, deleted{};
+    uintmax_t kept_bytes{};
+    bool over_limit{ false };
+    for (const auto &entry: entries) {
+      over_limit = over_limit
+	|| (policy.max_files != 0 && kept + 1 > policy.max_files)
+	|| (policy.max_bytes != 0 && kept_bytes + entry.size > policy.max_bytes)
+	|| (policy.max_age.count() != 0 && now - entry.mtime > policy.max_age);
+      if (over_limit) {
+	deleted += ::std::filesystem::remove(entry.path, ec);
+	continue;
+      }
+
+      kept++;
+      kept_bytes += entry.size;
+    }
+
+    return deleted;
+  }
+}
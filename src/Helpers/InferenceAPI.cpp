@@ -7,6 +7,14 @@ namespace InferenceAPI {
   char *python_executable_path = NULL;
   ::std::string graph_upload_dir = "";
   ::std::string peak_output_dir = "";
+  ::ResultCache::ShardedLRU *result_cache = nullptr;
+  ::Postprocess::RankOptions default_rank_options;
+  ::PeakFit::Engine peak_fit_engine = ::PeakFit::Engine::PYTHON;
+  ::PeakFit::Options peak_fit_options;
+  double peak_fit_validation_ppm = 0.0;
+  PeakFitWorkerPool *peak_fit_workers = nullptr;
+  bool audit_enabled = false;
+  ::FileUtils::RetentionPolicy audit_retention{};
   
   // -----------------
   // File Validation
@@ -78,76 +86,442 @@ namespace InferenceAPI {
 
   
   // ------------------
-  // Data Processing
+  // Result Cache
   // ------------------
-  
-  // ---- Preprocess data before using it as input to model ----
-  Matrix<double> preprocess_func(crow::json::rvalue &req_body, crow::json::wvalue &res_body, Storage &storage) {
-    auto mz_values = req_body["mz_array"];
-    ::Chem::unenc_compound ion(req_body["reagant_ion"].s());
 
+  // ---- Sort the candidates of one m/z by score into a cache entry ----
+  static ::std::shared_ptr<const ::ResultCache::Entry> make_cache_entry(const ::Chem::CompoundList &encoded_compounds,
+									 const ::std::vector<double> &theoretical_masses,
+									 const Matrix<double> &preds,
+									 size_t begin,
+									 size_t end) {
+    ::std::vector<size_t> order(end - begin);
+    ::std::iota(order.begin(), order.end(), begin);
+    ::std::stable_sort(order.begin(), order.end(), [&preds] (size_t a, size_t b) {
+      return preds.get(a, 0) > preds.get(b, 0);
+    });
+
+    auto entry = ::std::make_shared<::ResultCache::Entry>();
+    entry->encoded_compounds.reserve(order.size());
+    entry->theoretical_masses.reserve(order.size());
+    entry->scores.reserve(order.size());
+    for (auto row: order) {
+      entry->encoded_compounds.push_back(encoded_compounds[row]);
+      entry->theoretical_masses.push_back(theoretical_masses[row]);
+      entry->scores.push_back(preds.get(row, 0));
+    }
+
+    return entry;
+  }
+
+  // ---- Add the cached results to the freshly predicted rows ----
+  static void merge_cached_results(Matrix<double> &preds, Storage &storage) {
+    size_t n_rows = preds.get_rows();
+    for (const auto &cached: storage.cached)
+      n_rows += cached.entry->scores.size();
+
+    auto merged_preds = ::std::make_unique<double[]>(n_rows);
+    auto merged_ppms = ::std::make_unique<double[]>(n_rows);
+    storage.encoded_compounds.reserve(n_rows);
+
+    size_t row{};
+    for (; row < preds.get_rows(); row++) {
+      merged_preds[row] = preds.get(row, 0);
+      merged_ppms[row] = storage.ppms.get(row, 0);
+    }
+
+    // The ppm is recomputed so it matches the requested m/z rather than the one that filled the cache
+    for (const auto &cached: storage.cached) {
+      const auto &entry = *cached.entry;
+      ::Chem::get_ppms(cached.mz, entry.theoretical_masses, merged_ppms.get() + row);
+      for (size_t i{}; i < entry.scores.size(); i++, row++)
+	merged_preds[row] = entry.scores[i];
+
+      storage.encoded_compounds.insert(storage.encoded_compounds.end(), entry.encoded_compounds.begin(), entry.encoded_compounds.end());
+    }
+
+    preds = Matrix<double>(n_rows, 1, ::std::move(merged_preds));
+    storage.ppms = Matrix<double>(n_rows, 1, ::std::move(merged_ppms));
+  }
+
+  // ---- Set up the m/z result cache from the api config ----
+  void init_result_cache(const ::YAML::Node &config) {
+    auto cache_config = config["api"]["result_cache"];
+    auto max_candidates = cache_config["max_candidates"].as<size_t>();
+    if (max_candidates == 0)
+      return;
+
+    // Leak by design like the chem map, request handlers may still hold it at shutdown
+    ::InferenceAPI::result_cache = new ::ResultCache::ShardedLRU(max_candidates,
+								 cache_config["n_shards"].as<size_t>(),
+								 cache_config["mz_resolution"].as<double>());
+  }
+
+  // ---- Report the cache counters so its size and resolution can be tuned ----
+  void cache_stats(const crow::request &req, crow::response &res, GBModel<XGTreeBooster> *model) {
+    crow::json::wvalue body;
+    body["enabled"] = result_cache != nullptr;
+
+    if (result_cache != nullptr) {
+      auto stats = result_cache->get_stats();
+      body["hits"] = stats.hits;
+      body["misses"] = stats.misses;
+      body["evictions"] = stats.evictions;
+      body["entries"] = stats.entries;
+      body["candidates"] = stats.candidates;
+    }
+
+    res.add_header("Content-Type", "application/json");
+    res.write(body.dump());
+    res.end();
+  }
+
+  // ------------------
+  // Ranking
+  // ------------------
+
+  // ---- Set up the default top k, score threshold and page size from the api config ----
+  void init_ranking(const ::YAML::Node &config) {
+    auto ranking_config = config["api"]["ranking"];
+    default_rank_options.top_k = ranking_config["top_k"].as<size_t>();
+    default_rank_options.min_score = ranking_config["min_score"].as<double>() / 100; // the config uses percentages like the responses
+    default_rank_options.page_size = ranking_config["page_size"].as<size_t>();
+  }
+
+  static void hash_combine(uint64_t &h, uint64_t value) {
+    h ^= ::std::hash<uint64_t>{}(value) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  }
+
+  // ---- A cursor is the offset of the next page and the fingerprint of the request it belongs to ----
+  static ::std::string make_cursor(size_t offset, uint64_t fingerprint) {
+    // Decimal offset, '.' and hex fingerprint
+    char buf[::std::numeric_limits<size_t>::digits10 + 1 + 1 + sizeof(uint64_t) * 2];
+    auto res = ::std::to_chars(buf, buf + sizeof(buf) - 1, offset);
+    if (res.ec != ::std::errc())
+      throw ::std::runtime_error("Cursor error -- offset " + ::std::to_string(offset) + " doesn't fit in a cursor");
+
+    *res.ptr++ = '.';
+    res = ::std::to_chars(res.ptr, buf + sizeof(buf), fingerprint, 16);
+    if (res.ec != ::std::errc())
+      throw ::std::runtime_error("Cursor error -- fingerprint doesn't fit in a cursor");
+
+    return { buf, res.ptr };
+  }
+
+  static size_t parse_cursor(::std::string_view cursor, uint64_t fingerprint) {
+    size_t offset{};
+    uint64_t cursor_fingerprint{};
+    auto dot = cursor.find('.');
+    if (dot == ::std::string_view::npos
+	|| ::std::from_chars(cursor.data(), cursor.data() + dot, offset).ptr != cursor.data() + dot
+	|| ::std::from_chars(cursor.data() + dot + 1, cursor.data() + cursor.size(), cursor_fingerprint, 16).ptr != cursor.data() + cursor.size())
+      throw ::std::invalid_argument("Invalid cursor: " + ::std::string(cursor));
+
+    if (cursor_fingerprint != fingerprint)
+      throw ::std::invalid_argument("Invalid cursor: it belongs to a request with different m/z values, reagent ion, top_k or min_score");
+
+    return offset;
+  }
+
+  // ---- Fingerprint the request and read its cursor, a cursor has to come from the same m/z values, ion and filters ----
+  static void set_rank_options(const PredictRequest &request, Storage &storage) {
+    storage.rank_options = request.rank_options;
+
+    uint64_t fingerprint = static_cast<uint8_t>(request.reagant_ion);
+    for (double mz: request.mz_values)
+      hash_combine(fingerprint, ::std::bit_cast<uint64_t>(mz));
+    hash_combine(fingerprint, request.rank_options.top_k);
+    hash_combine(fingerprint, ::std::bit_cast<uint64_t>(request.rank_options.min_score));
+    storage.request_fingerprint = fingerprint;
+
+    storage.rank_options.offset = request.cursor.empty() ? 0 : parse_cursor(request.cursor, fingerprint);
+  }
+
+  // ------------------
+  // Request Parsing
+  // ------------------
+
+  static ::Chem::ReagantIon parse_reagant_ion(::std::string_view ion_name) {
     // SoarAI currently only supports ammonium and nitrosyl reagant ions
-    if (ion.val == "def" || !(ion.val == "NH4" || ion.val == "NO"))
-      throw ::std::invalid_argument("Invalid reagent ion: " + ion.val);
-
-    ::std::vector< Matrix<double> > model_data_matrices;
-    ::std::vector< Matrix<double> > encoded_compounds_matrices;
-    ::std::vector< Matrix<double> > ppm_matrices;
-    model_data_matrices.reserve(mz_values.size());
-    encoded_compounds_matrices.reserve(mz_values.size());
-    ppm_matrices.reserve(mz_values.size());
-  
-    size_t total_rows{ 0 };
-    res_body["critereaEncodings"] = crow::json::wvalue::list();
+    auto ion = ::Chem::ChemMap::get_chem_map()->get_reagant_ion(ion_name);
+    if (ion == ::Chem::ReagantIon::NONE)
+      throw ::std::invalid_argument("Invalid reagent ion: " + ::std::string(ion_name));
 
-    for (size_t i = 0; i < mz_values.size(); i++) {
-      auto data = Preprocess::mz_to_data(mz_values[i].d(), ion);
+    return ion;
+  }
 
-      size_t temp = total_rows;
-      total_rows += data.model_data.get_rows();
-    
-      for (size_t j = temp; j < total_rows; j++) {
-	res_body["critereaEncodings"][j] = crow::json::wvalue::list();
-	for (int k = 0; k < 4; k++) {
-	  res_body["critereaEncodings"][j][k] = data.model_data.get(j - temp, k);
-	}
+  static size_t get_count_field(const crow::json::rvalue &req_body, const char *name, size_t default_value) {
+    if (!req_body.has(name))
+      return default_value;
+
+    auto value = req_body[name].i();
+    if (value < 0)
+      throw ::std::invalid_argument(::std::string("Invalid ") + name + ": it can't be negative");
+
+    return static_cast<size_t>(value);
+  }
+
+  // ---- Read a JSON request, the ranking fields are optional ----
+  static PredictRequest parse_json_request(const crow::json::rvalue &req_body) {
+    PredictRequest request;
+    request.reagant_ion = parse_reagant_ion(::std::string(req_body["reagant_ion"].s()));
+
+    auto &options = request.rank_options;
+    options = default_rank_options;
+    options.top_k = get_count_field(req_body, "top_k", options.top_k);
+    options.page_size = get_count_field(req_body, "page_size", options.page_size);
+    if (req_body.has("min_score"))
+      options.min_score = req_body["min_score"].d() / 100;
+
+    if (req_body.has("cursor"))
+      request.cursor = ::std::string(req_body["cursor"].s());
+
+    auto mz_values = req_body["mz_array"];
+    request.mz_storage.reserve(mz_values.size());
+    for (size_t i = 0; i < mz_values.size(); i++)
+      request.mz_storage.push_back(mz_values[i].d());
+
+    request.mz_values = request.mz_storage;
+    return request;
+  }
+
+  static size_t get_count_param(const crow::request &req, const char *name, size_t default_value) {
+    const char *param = req.url_params.get(name);
+    if (param == nullptr)
+      return default_value;
+
+    size_t value;
+    ::std::string_view param_view(param);
+    if (::std::from_chars(param_view.data(), param_view.data() + param_view.size(), value).ptr != param_view.data() + param_view.size())
+      throw ::std::invalid_argument(::std::string("Invalid ") + name + ": " + param);
+
+    return value;
+  }
+
+  // ---- Read a binary request, the m/z values are used in place when the body is suitably aligned ----
+  static PredictRequest parse_binary_request(const crow::request &req) {
+    ::std::string_view body(req.body);
+    if (body.size() < sizeof(BinaryRequestHeader))
+      throw ::std::invalid_argument("Binary request is too small to hold its header");
+
+    BinaryRequestHeader header;
+    ::std::memcpy(&header, body.data(), sizeof(BinaryRequestHeader));
+    if (::std::memcmp(header.magic, REQUEST_MAGIC, sizeof(REQUEST_MAGIC)) != 0 || header.version != REQUEST_VERSION)
+      throw ::std::invalid_argument("Binary request has an unknown header");
+
+    if (header.n_mz != (body.size() - sizeof(BinaryRequestHeader)) / sizeof(double)
+	|| (body.size() - sizeof(BinaryRequestHeader)) % sizeof(double) != 0)
+      throw ::std::invalid_argument("Binary request size doesn't match its m/z count");
+
+    PredictRequest request;
+    request.reagant_ion = parse_reagant_ion({ header.reagant_ion, ::strnlen(header.reagant_ion, sizeof(header.reagant_ion)) });
+
+    // The ranking comes from the query string since the header only names the ion
+    auto &options = request.rank_options;
+    options = default_rank_options;
+    options.top_k = get_count_param(req, "top_k", options.top_k);
+    options.page_size = get_count_param(req, "page_size", options.page_size);
+    if (const char *min_score = req.url_params.get("min_score")) {
+      ::std::string_view min_score_view(min_score);
+      if (::std::from_chars(min_score_view.data(), min_score_view.data() + min_score_view.size(), options.min_score).ptr
+	  != min_score_view.data() + min_score_view.size())
+	throw ::std::invalid_argument(::std::string("Invalid min_score: ") + min_score);
+      options.min_score /= 100;
+    }
+
+    if (const char *cursor = req.url_params.get("cursor"))
+      request.cursor = cursor;
+
+    const char *values = body.data() + sizeof(BinaryRequestHeader);
+    bool aligned = reinterpret_cast<uintptr_t>(values) % alignof(double) == 0;
+    if constexpr (::std::endian::native == ::std::endian::little) {
+      if (aligned) {
+	request.mz_values = { reinterpret_cast<const double *>(values), header.n_mz };
+	return request;
       }
-    
-      model_data_matrices.push_back(::std::move(data.model_data));
-      encoded_compounds_matrices.push_back(::std::move(data.encoded_compounds));
-      ppm_matrices.push_back(::std::move(data.ppms));
     }
 
-    auto ec = Matrix<double>::combine_vertically(encoded_compounds_matrices, total_rows);
-    auto ppms = Matrix<double>::combine_vertically(ppm_matrices, total_rows);
-    auto res = Matrix<double>::combine_vertically(model_data_matrices, total_rows);
+    request.mz_storage.resize(header.n_mz);
+    for (size_t i{}; i < header.n_mz; i++) {
+      uint64_t bits;
+      ::std::memcpy(&bits, values + i * sizeof(double), sizeof(double));
+      if constexpr (::std::endian::native != ::std::endian::little)
+	bits = __builtin_bswap64(bits);
+      request.mz_storage[i] = ::std::bit_cast<double>(bits);
+    }
+
+    request.mz_values = request.mz_storage;
+    return request;
+  }
+
+  // ------------------
+  // Data Processing
+  // ------------------
   
-    storage.encoded_compounds = ::std::move(ec);
-    storage.ppms = ::std::move(ppms);
+  // ---- Only finite m/z in (0, MAX_MZ] can be enumerated and turned into cache keys, whatever format the request came in ----
+  static void validate_mz_values(::std::span<const double> mz_values) {
+    for (double mz: mz_values) {
+      if (::std::isfinite(mz) && mz > 0 && mz <= MAX_MZ)
+	continue;
+
+      ::std::ostringstream oss;
+      oss << "Invalid m/z: " << mz << ", m/z values have to be finite, positive and at most " << MAX_MZ;
+      throw ::std::invalid_argument(oss.str());
+    }
+  }
+
+  // ---- Parse a request, answer what the result cache can and prepare the rest as input to the model ----
+  static Matrix<double> prepare_request(const PredictRequest &request, Storage &storage, bool keep_model_rows = false) {
+    auto ion = request.reagant_ion;
+    validate_mz_values(request.mz_values);
+    set_rank_options(request, storage);
+
+    ::std::vector<double> mz_array;
+    mz_array.reserve(request.mz_values.size());
+    storage.cached.clear();
+    ::std::unordered_set<int64_t> cached_buckets;
+    for (double mz: request.mz_values) {
+      if (result_cache != nullptr) {
+	auto key = result_cache->make_key(ion, mz);
+	if (auto entry = result_cache->get(key)) {
+	  if (cached_buckets.insert(key.mz_bucket).second)
+	    storage.cached.push_back({ mz, ::std::move(entry) });
+	  continue;
+	}
+      }
+
+      mz_array.push_back(mz);
+    }
+
+    auto data = Preprocess::mz_to_data_batch(mz_array, ion);
+    storage.encoded_compounds = ::std::move(data.encoded_compounds);
+    storage.ppms = ::std::move(data.ppms);
+    storage.reagant_ion = ion;
+    storage.mz = ::std::move(data.mz);
+    storage.row_offsets = ::std::move(data.row_offsets);
+    storage.theoretical_masses = ::std::move(data.theoretical_masses);
+
+    // The caller can't skip the model on 0 rows, it gets one placeholder row whose prediction rank_results drops
+    storage.model_placeholder = keep_model_rows && data.model_data.get_rows() == 0;
+    if (storage.model_placeholder)
+      return Matrix<double>(1, MODEL_FEATURES, ::std::make_unique<double[]>(MODEL_FEATURES));
   
-    return res;
+    return ::std::move(data.model_data);
+  }
+
+  // ---- Cache the new predictions, then rank and decode the page of candidates the request asked for ----
+  static ::ResponseWriter::Response rank_results(Matrix<double> &preds, Storage &storage) {
+    if (storage.model_placeholder)
+      preds = Matrix<double>(0, 1, ::std::make_unique<double[]>(0));
+
+    if (result_cache != nullptr) {
+      for (size_t i = 0; i < storage.mz.size(); i++) {
+	result_cache->put(result_cache->make_key(storage.reagant_ion, storage.mz[i]),
+			  make_cache_entry(storage.encoded_compounds,
+					   storage.theoretical_masses,
+					   preds,
+					   storage.row_offsets[i],
+					   storage.row_offsets[i + 1]));
+      }
+
+      if (!storage.cached.empty())
+	merge_cached_results(preds, storage);
+    }
+
+    // Every m/z is its own group for top_k, cached m/z values were merged after the predicted ones
+    auto group_offsets = storage.row_offsets;
+    for (const auto &cached: storage.cached)
+      group_offsets.push_back(group_offsets.back() + cached.entry->scores.size());
+
+    auto page = Postprocess::rank_preds(preds, group_offsets, storage.rank_options);
+
+    // Only the rows of the page are decoded
+    ::Chem::CompoundList page_compounds;
+    page_compounds.reserve(page.rows.size());
+    for (auto row: page.rows)
+      page_compounds.push_back(storage.encoded_compounds[row]);
+
+    ::ResponseWriter::Response response;
+    response.scores.reserve(page.rows.size());
+    response.ppms.reserve(page.rows.size());
+    for (auto row: page.rows) {
+      response.scores.push_back(preds.get(row, 0) * 100); // convert to percentage
+      response.ppms.push_back(storage.ppms.get(row, 0));
+    }
+
+    response.crit_bits.resize(page.rows.size());
+    ::Chem::get_criterea_bits_batch(page_compounds, response.crit_bits.data());
+    Preprocess::decode_compounds(page_compounds, &response.u_compounds, &response.compounds);
+
+    response.total_candidates = page.n_ranked;
+    if (page.next_offset < page.n_ranked)
+      response.next_cursor = make_cursor(page.next_offset, storage.request_fingerprint);
+
+    return response;
+  }
+
+  // ---- Preprocess data before using it as input to model, CNum's /predict route runs the model on whatever is returned ----
+  Matrix<double> preprocess_func(crow::json::rvalue &req_body, crow::json::wvalue &res_body, Storage &storage) {
+    auto model_data = prepare_request(parse_json_request(req_body), storage, true);
+    return model_data;
   }
 
   // ---- Postprocess data and save in the response ----
   void postprocess_func(Matrix<double> &preds, crow::json::wvalue &res_body, Storage &storage) {
-    Postprocess::sort_preds(::std::ref(storage.encoded_compounds),
-			    ::std::ref(preds),
-			    ::std::ref(storage.ppms));
-
-    auto decoded_unsimplified_compounds = Preprocess::decode_compounds(storage.encoded_compounds);
-    auto decoded_simplified_compounds = Preprocess::decode_compounds(Preprocess::simplify_compounds(storage.encoded_compounds));
+    auto response = rank_results(preds, storage);
   
     res_body["scores"] = crow::json::wvalue::list();
     res_body["compounds"] = crow::json::wvalue::list();
     res_body["uCompounds"] = crow::json::wvalue::list();
     res_body["ppms"] = crow::json::wvalue::list();
+    res_body["critereaEncodings"] = crow::json::wvalue::list();
 
-    for (size_t i = 0; i < preds.get_rows(); i++) {
-      res_body["scores"][i] = preds.get(i, 0) * 100; // convert to percentage
-      res_body["compounds"][i] = decoded_simplified_compounds[i].val;
-      res_body["uCompounds"][i] = decoded_unsimplified_compounds[i].val;
-      res_body["ppms"][i] = storage.ppms.get(i, 0);
+    for (size_t i = 0; i < response.size(); i++) {
+      res_body["scores"][i] = response.scores[i];
+      res_body["compounds"][i] = ::std::string(response.compounds[i]);
+      res_body["uCompounds"][i] = ::std::string(response.u_compounds[i]);
+      res_body["ppms"][i] = response.ppms[i];
+      res_body["critereaEncodings"][i] = crow::json::wvalue::list();
+      for (size_t k = 0; k < ::Chem::N_CRITEREA; k++) {
+	res_body["critereaEncodings"][i][k] = static_cast<double>((response.crit_bits[i] >> k) & 1);
+      }
     }
+
+    res_body["totalCandidates"] = response.total_candidates;
+    if (!response.next_cursor.empty())
+      res_body["nextCursor"] = response.next_cursor;
+  }
+
+  // ---- Same request and ranking as /predict, serialized straight into the body as JSON or binary columns ----
+  void predict_stream(const crow::request &req, crow::response &res, GBModel<XGTreeBooster> *model) {
+    Storage storage;
+    ::ResponseWriter::Response response;
+    try {
+      PredictRequest request;
+      if (req.get_header_value("Content-Type").find(BINARY_REQUEST_CONTENT_TYPE) != ::std::string::npos) {
+	request = parse_binary_request(req);
+      } else {
+	auto req_body = crow::json::load(req.body);
+	if (!req_body || !req_body.has("mz_array") || !req_body.has("reagant_ion"))
+	  throw ::std::invalid_argument("Request body must be JSON with mz_array and reagant_ion");
+	request = parse_json_request(req_body);
+      }
+
+      auto model_data = prepare_request(request, storage);
+      auto preds = model_data.get_rows() != 0
+	? model->predict(model_data)
+	: Matrix<double>(0, 1, ::std::make_unique<double[]>(0));
+      response = rank_results(preds, storage);
+    } catch (const ::std::invalid_argument &e) {
+      res = crow::response(400, e.what());
+      res.end();
+      return;
+    }
+
+    auto format = ::ResponseWriter::negotiate_format(req.get_header_value("Accept"));
+    ::ResponseWriter::write(format, response, res.body);
+    res.add_header("Content-Type", ::std::string(::ResponseWriter::get_content_type(format)));
+    res.end();
   }
 
   // --------------------
@@ -192,6 +566,95 @@ namespace InferenceAPI {
     page_break(oss);
   }
 
+  // ---- Run the external fit_peaks tool on the uploads and get its peaks back ----
+  static ::std::vector<double> fit_peaks_python(const ::std::array<crow::multipart::part, N_FILES> &parts) {
+    // Long lived workers take the spectrum over a pipe, no files or process start up
+    if (peak_fit_workers != nullptr)
+      return peak_fit_workers->fit(parts[0].body, parts[1].body);
+
+    // The tool opens the in memory files by path through the descriptors it inherits
+    ::FileUtils::MemFile mz_base("mz_base"), mz_av("mz_av"), peaks("peaks");
+    mz_base.write(parts[0].body);
+    mz_av.write(parts[1].body);
+    execute_peak_fit_bin(mz_base.child_path(), mz_av.child_path(), peaks.child_path(), { mz_base.fd(), mz_av.fd(), peaks.fd() });
+
+    ::std::vector<double> peak_mzs;
+    auto peaks_text = peaks.read_all();
+    ::std::string_view text(peaks_text);
+    while (!text.empty()) {
+      auto line = ::FileUtils::next_line(text);
+      double mz;
+      if (line.empty())
+	continue;
+
+      if (!::FileUtils::parse_double(line, mz))
+	throw ::std::runtime_error("Error in /process-graph - fit_peaks wrote a bad peak " + ::std::string(line));
+      peak_mzs.push_back(mz);
+    }
+
+    return peak_mzs;
+  }
+
+  // ---- Peaks of the uploaded spectrum found by the in process detector ----
+  static ::std::vector<double> fit_peaks_native(const ::std::array<crow::multipart::part, N_FILES> &parts) {
+    ::std::vector<double> native_mzs;
+    auto spectrum = ::PeakFit::make_spectrum(parts[0].body, parts[1].body);
+    for (const auto &peak: ::PeakFit::find_peaks(spectrum, peak_fit_options))
+      native_mzs.push_back(peak.mz);
+
+    return native_mzs;
+  }
+
+  // ---- Peaks of the uploaded spectrum found by the configured engine ----
+  static ::std::vector<double> detect_peaks(const ::std::array<crow::multipart::part, N_FILES> &parts) {
+    if (peak_fit_engine == ::PeakFit::Engine::NATIVE)
+      return fit_peaks_native(parts);
+
+    auto python_mzs = fit_peaks_python(parts);
+    if (peak_fit_engine != ::PeakFit::Engine::VALIDATE)
+      return python_mzs;
+
+    // The python peaks are the answer in validate mode, a native failure is only logged
+    try {
+      auto native_mzs = fit_peaks_native(parts);
+      auto sorted_python_mzs = python_mzs;
+      ::std::sort(sorted_python_mzs.begin(), sorted_python_mzs.end());
+      auto comparison = ::PeakFit::compare_peaks(sorted_python_mzs, native_mzs, peak_fit_validation_ppm);
+      ::std::cerr << "Peak fit validation - python " << sorted_python_mzs.size() << " peaks, native " << native_mzs.size()
+		  << " peaks, matched " << comparison.matched << " (max " << comparison.max_ppm << " ppm), missed "
+		  << comparison.missed << ", extra " << comparison.extra << ::std::endl;
+    } catch (const ::std::exception &e) {
+      ::std::cerr << "Peak fit validation - native engine failed: " << e.what() << ::std::endl;
+    }
+
+    return python_mzs;
+  }
+
+  // ---- Keep the uploads and their peaks on disk for auditing, then trim the audit directories back to the retention limits ----
+  static void audit_spectrum(const ::std::array<crow::multipart::part, N_FILES> &parts, const ::std::vector<double> &peak_mzs) {
+    static ::std::mutex retention_mtx;
+    auto write_file = [] (const ::std::string &path, ::std::string_view bytes) {
+      ::std::ofstream os(path, ::std::ios::binary);
+      os.write(bytes.data(), bytes.size());
+      if (!os.good())
+	::std::cerr << "Error in /process-graph - couldn't write audit file " << path << ::std::endl;
+    };
+
+    auto prefix = make_unique_filename("", "");
+    write_file(graph_upload_dir + prefix + "_base.csv", parts[0].body);
+    write_file(graph_upload_dir + prefix + "_av.csv", parts[1].body);
+
+    ::std::ostringstream oss;
+    oss.precision(::std::numeric_limits<double>::max_digits10);
+    for (double mz: peak_mzs)
+      oss << mz << '\n';
+    write_file(peak_output_dir + prefix + ".txt", oss.str());
+
+    ::std::lock_guard<::std::mutex> lg(retention_mtx);
+    ::FileUtils::enforce_retention(graph_upload_dir, audit_retention);
+    ::FileUtils::enforce_retention(peak_output_dir, audit_retention);
+  }
+
   // ---- Take in a mass spectra, find and fit peaks, make predictions, and postprocess ----
   void process_graph(const crow::request &req, crow::response &res, GBModel<XGTreeBooster> *model) {
     const auto content_type = req.get_header_value("Content-Type");
@@ -203,68 +666,75 @@ namespace InferenceAPI {
   
     crow::multipart::message msg(req);
     ::std::array<crow::multipart::part, N_FILES> parts;
-    ::std::array<::std::string, N_FILES> filenames;
     
-    ::Chem::unenc_compound reagentIon{ msg.get_part_by_name("reagentIon").body };
+    const auto &reagent_ion_name = msg.get_part_by_name("reagentIon").body;
+    auto reagentIon = ::Chem::ChemMap::get_chem_map()->get_reagant_ion(reagent_ion_name);
+    if (reagentIon == ::Chem::ReagantIon::NONE) {
+      res = crow::response(400, "Invalid reagent ion: " + reagent_ion_name);
+      res.end();
+      return;
+    }
+
     parts[0] = msg.get_part_by_name("base");
     parts[1] = msg.get_part_by_name("av");
 
-    for (int i = 0; i < N_FILES; i++) {
-      const auto cd = parts[i].get_header_object("Content-Disposition");
-      auto it = cd.params.find("filename");
-      if (it != cd.params.end() && !it->second.empty())
-	filenames[i] = make_unique_filename(::InferenceAPI::graph_upload_dir, ".csv");
-
+    for (int i = 0; i < N_FILES; i++)
       validate_file_upload(parts[i]);
-      ::std::ofstream os(filenames[i], ::std::ios::binary);
 
-      if (!os.is_open()) {
-	::std::cerr << "Error in /process_graph - Failed to open file" << ::std::endl;
-	res = crow::response(500, "Error in /process_graph - Failed to open " + filenames[i]);
-	res.end();
-	return;
-      }
-      
-      os << parts[i].body;
-      os.close();
-    }
-
-    auto peaks_file_path = make_unique_filename(peak_output_dir, ".txt");
-    execute_peak_fit_bin(filenames[0], filenames[1], peaks_file_path);
-
-    ::std::ifstream is(peaks_file_path, ::std::ios::binary);
-    if (!is.is_open()) {
-      res = crow::response(500, "Error in /process-graph - couldn't open " + peaks_file_path);
+    ::std::vector<double> peak_mzs;
+    try {
+      peak_mzs = detect_peaks(parts);
+    } catch (const ::std::invalid_argument &e) {
+      res = crow::response(400, e.what());
+      res.end();
+      return;
+    } catch (const ::std::runtime_error &e) {
+      ::std::cerr << e.what() << ::std::endl;
+      res = crow::response(500, e.what());
       res.end();
       return;
     }
 
-    ::std::ostringstream oss(::std::ios::binary);
-    ::std::string line;
-    while (getline(is, line, '\n')) {
-      double mz_value;
-      mz_value = stod(line);
+    if (audit_enabled)
+      audit_spectrum(parts, peak_mzs);
 
-      auto data = Preprocess::mz_to_data(mz_value, reagentIon);
-      if (data.model_data.get_rows() == 0) continue;
+    ::std::ostringstream oss(::std::ios::binary);
+    Preprocess::FormulaArena decoded_compounds; // reused by every peak
+    for (double mz_value: peak_mzs) {
+      ::std::shared_ptr<const ::ResultCache::Entry> entry;
+      if (result_cache != nullptr)
+	entry = result_cache->get(result_cache->make_key(reagentIon, mz_value));
+
+      if (entry == nullptr) {
+	auto data = Preprocess::mz_to_data(mz_value, reagentIon);
+	if (data.model_data.get_rows() == 0) continue;
     
-      auto preds = model->predict(data.model_data);
+	auto preds = model->predict(data.model_data);
+	entry = make_cache_entry(data.encoded_compounds, data.theoretical_masses, preds, 0, preds.get_rows());
 
-      if (data.model_data.get_rows() > 1)
-	Postprocess::sort_preds(data.encoded_compounds, preds, data.ppms);
+	if (result_cache != nullptr)
+	  result_cache->put(result_cache->make_key(reagentIon, mz_value), entry);
+      }
     
-      auto decoded_compounds = Preprocess::decode_compounds(Preprocess::simplify_compounds(data.encoded_compounds));
+      // Entries are sorted by score, so the default top_k and min_score just cut them short
+      size_t n_shown = entry->scores.size();
+      if (default_rank_options.top_k != 0)
+	n_shown = ::std::min(n_shown, default_rank_options.top_k);
+      while (n_shown > 0 && entry->scores[n_shown - 1] < default_rank_options.min_score)
+	n_shown--;
+
+      Preprocess::decode_compounds(::std::span(entry->encoded_compounds).first(n_shown), nullptr, &decoded_compounds);
 
       oss.setf(::std::ios::left, ::std::ios::adjustfield);
       oss << mz_value << ":" << ::std::endl;
       print_header(oss);
-      for (size_t i = 0; i < decoded_compounds.size(); i++) {
-	print_row(oss, { decoded_compounds[i].val, ::std::to_string(data.ppms.get(i, 0)), ::std::to_string(preds.get(i, 0)) });
+      for (size_t i = 0; i < n_shown; i++) {
+	double ppm = ::Chem::get_ppm(mz_value, entry->theoretical_masses[i]);
+	print_row(oss, { ::std::string(decoded_compounds[i]), ::std::to_string(ppm), ::std::to_string(entry->scores[i]) });
       }
       page_break(oss);
     }
 
-    is.close();
     if (!res.body.empty())
       res.body = "";
     res.write(oss.str());
@@ -272,6 +742,37 @@ namespace InferenceAPI {
     res.end();
   }
 
+  // ---- Pick the peak fitting engine and its settings from the api config ----
+  void init_peak_fit(const ::YAML::Node &config) {
+    auto peak_fit_config = config["api"]["peak_fit"];
+    peak_fit_engine = ::PeakFit::parse_engine(peak_fit_config["engine"].as<::std::string>());
+    peak_fit_options.profile = ::PeakFit::parse_profile(peak_fit_config["profile"].as<::std::string>());
+    peak_fit_options.baseline_window = peak_fit_config["baseline_window"].as<size_t>();
+    peak_fit_options.min_snr = peak_fit_config["min_snr"].as<double>();
+    peak_fit_options.max_fit_half_width = peak_fit_config["max_fit_half_width"].as<size_t>();
+    peak_fit_options.max_iterations = peak_fit_config["max_iterations"].as<size_t>();
+    peak_fit_validation_ppm = peak_fit_config["validation_tolerance_ppm"].as<double>();
+
+    auto n_workers = peak_fit_config["python_workers"].as<size_t>();
+    if (n_workers == 0 || peak_fit_engine == ::PeakFit::Engine::NATIVE)
+      return;
+
+    // Leak by design like the result cache, request handlers may still hold a worker at shutdown
+    peak_fit_workers = new PeakFitWorkerPool(python_executable_path,
+					     peak_fit_config["python_worker_args"].as<::std::vector<::std::string>>(),
+					     n_workers,
+					     ::std::chrono::milliseconds(peak_fit_config["python_worker_timeout_ms"].as<long long>()));
+  }
+
+  // ---- Uploads are only kept on disk when auditing is turned on, within its retention limits ----
+  void init_audit(const ::YAML::Node &config) {
+    auto audit_config = config["api"]["audit"];
+    audit_enabled = audit_config["enabled"].as<bool>();
+    audit_retention.max_files = audit_config["max_files"].as<size_t>();
+    audit_retention.max_bytes = audit_config["max_megabytes"].as<uintmax_t>() << 20;
+    audit_retention.max_age = ::std::chrono::hours(audit_config["max_age_hours"].as<long long>());
+  }
+
   void resolve_paths(const ::YAML::Node &config) {
     auto py_ex_path = config["paths"]["api"]["peak_fit_binary"].as<::std::string>();
     ::InferenceAPI::python_executable_path = (char *) malloc(sizeof(char) * (py_ex_path.size() + 1));
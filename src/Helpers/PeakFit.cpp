@@ -0,0 +1,403 @@
+#include "PeakFit.h"
+
+namespace PeakFit {
+  // ------------------
+  // Config
+  // ------------------
+
+  Engine parse_engine(const ::std::string &engine) {
+    if (engine == "python")
+      return Engine::PYTHON;
+
+    if (engine == "native")
+      return Engine::NATIVE;
+
+    if (engine == "validate")
+      return Engine::VALIDATE;
+
+    throw ::std::invalid_argument("Peak fit error -- unknown engine " + engine + " (python|native|validate)");
+  }
+
+  Profile parse_profile(const ::std::string &profile) {
+    if (profile == "gaussian")
+      return Profile::GAUSSIAN;
+
+    if (profile == "pseudo_voigt")
+      return Profile::PSEUDO_VOIGT;
+
+    throw ::std::invalid_argument("Peak fit error -- unknown profile " + profile + " (gaussian|pseudo_voigt)");
+  }
+
+  // ------------------
+  // Parsing
+  // ------------------
+
+  // ---- Values of a one column csv with a header line, the upload was already validated ----
+  ::std::vector<double> parse_column(::std::string_view csv) {
+    ::std::vector<double> values;
+    size_t pos = csv.find('\n');
+    while (pos != ::std::string_view::npos && pos + 1 < csv.size()) {
+      size_t start = pos + 1;
+      pos = csv.find('\n', start);
+      auto line = csv.substr(start, pos == ::std::string_view::npos ? ::std::string_view::npos : pos - start);
+      while (!line.empty() && ::std::isspace(static_cast<unsigned char>(line.back())))
+	line.remove_suffix(1);
+
+      if (line.empty())
+	continue;
+
+      double value;
+      auto [end, ec] = ::std::from_chars(line.data(), line.data() + line.size(), value);
+      if (ec != ::std::errc())
+	throw ::std::invalid_argument("Peak fit error -- bad value " + ::std::string(line));
+
+      values.push_back(value);
+    }
+
+    return values;
+  }
+
+  Spectrum make_spectrum(::std::string_view mz_csv, ::std::string_view intensity_csv) {
+    Spectrum spectrum{ parse_column(mz_csv), parse_column(intensity_csv) };
+    if (spectrum.mz.size() != spectrum.intensity.size())
+      throw ::std::invalid_argument("Peak fit error -- mz_base has " + ::std::to_string(spectrum.mz.size()) + " points but mz_av has "
+				    + ::std::to_string(spectrum.intensity.size()));
+
+    if (!::std::is_sorted(spectrum.mz.begin(), spectrum.mz.end()))
+      throw ::std::invalid_argument("Peak fit error -- mz_base has to be in ascending order");
+
+    return spectrum;
+  }
+
+  // ------------------
+  // Detection
+  // ------------------
+
+  // ---- Rolling minimum of [i - half, i + half] in O(n) with a monotonic deque ----
+  static ::std::vector<double> rolling_min(::std::span<const double> values, size_t half) {
+    size_t n = values.size();
+    ::std::vector<double> out(n);
+    ::std::deque<size_t> window; // indeces of increasing values
+    size_t next{};
+    for (size_t i{}; i < n; i++) {
+      for (; next < n && next <= i + half; next++) {
+	while (!window.empty() && values[window.back()] >= values[next])
+	  window.pop_back();
+	window.push_back(next);
+      }
+
+      while (window.front() + half < i)
+	window.pop_front();
+      out[i] = values[window.front()];
+    }
+
+    return out;
+  }
+
+  static ::std::vector<double> rolling_mean(::std::span<const double> values, size_t half) {
+    size_t n = values.size();
+    ::std::vector<double> prefix(n + 1, 0.0);
+    for (size_t i{}; i < n; i++)
+      prefix[i + 1] = prefix[i] + values[i];
+
+    ::std::vector<double> out(n);
+    for (size_t i{}; i < n; i++) {
+      size_t lo = i > half ? i - half : 0;
+      size_t hi = ::std::min(n, i + half + 1);
+      out[i] = (prefix[hi] - prefix[lo]) / (hi - lo);
+    }
+
+    return out;
+  }
+
+  // ---- Signal minus a smoothed rolling minimum baseline, clamped at 0 ----
+  ::std::vector<double> subtract_baseline(::std::span<const double> intensity, size_t window) {
+    size_t half = window / 2;
+    auto baseline = rolling_mean(rolling_min(intensity, half), half);
+
+    ::std::vector<double> signal(intensity.size());
+    for (size_t i{}; i < intensity.size(); i++)
+      signal[i] = ::std::max(intensity[i] - baseline[i], 0.0);
+
+    return signal;
+  }
+
+  // ---- Noise as the scaled median absolute deviation, robust to the peaks themselves ----
+  Noise estimate_noise(::std::span<const double> signal) {
+    if (signal.empty())
+      return { 0.0, 0.0 };
+
+    ::std::vector<double> values(signal.begin(), signal.end());
+    auto mid = values.begin() + values.size() / 2;
+    ::std::nth_element(values.begin(), mid, values.end());
+    double median = *mid;
+
+    for (auto &value: values)
+      value = ::std::abs(value - median);
+    ::std::nth_element(values.begin(), mid, values.end());
+    return { median, MAD_TO_SIGMA * *mid };
+  }
+
+  // ---- How far the apex rises above the lowest point before a higher one, searching at most max_search points each way ----
+  static double get_prominence(::std::span<const double> signal, size_t apex, size_t max_search) {
+    double left_min = signal[apex], right_min = signal[apex];
+    for (size_t i = apex; i > 0 && apex - i < max_search && signal[i - 1] <= signal[apex]; i--)
+      left_min = ::std::min(left_min, signal[i - 1]);
+    for (size_t i = apex + 1; i < signal.size() && i - apex <= max_search && signal[i] <= signal[apex]; i++)
+      right_min = ::std::min(right_min, signal[i]);
+
+    return signal[apex] - ::std::max(left_min, right_min);
+  }
+
+  // ---- Points above threshold that are higher than their left neighbour, at least as high as their right one and prominent enough ----
+  ::std::vector<size_t> find_local_maxima(::std::span<const double> signal, double threshold, double min_prominence, size_t max_search) {
+    ::std::vector<size_t> maxima;
+    for (size_t i = 1; i + 1 < signal.size(); i++) {
+      if (signal[i] > threshold && signal[i] > signal[i - 1] && signal[i] >= signal[i + 1]
+	  && get_prominence(signal, i, max_search) >= min_prominence)
+	maxima.push_back(i);
+    }
+
+    return maxima;
+  }
+
+  // ------------------
+  // Fitting
+  // ------------------
+
+  /* Parameters are { height, center, fwhm, eta } in window coordinates x' = (x - apex m/z) / scale,
+     Gaussians only fit the first 3 with eta held at 0 */
+  using Params = ::std::array<double, 4>;
+  constexpr double FOUR_LN2 = 2.772588722239781;
+
+  // ---- Profile value at x and its gradient with respect to the parameters ----
+  static double profile_value(const Params &p, double x, Params *grad) {
+    double d = x - p[1];
+    double inv_w2 = 1.0 / (p[2] * p[2]);
+    double g = ::std::exp(-FOUR_LN2 * d * d * inv_w2);
+    double l = 1.0 / (1.0 + 4.0 * d * d * inv_w2);
+    double shape = p[3] * l + (1.0 - p[3]) * g;
+
+    if (grad != nullptr) {
+      double dg_dc = g * 2.0 * FOUR_LN2 * d * inv_w2;
+      double dl_dc = l * l * 8.0 * d * inv_w2;
+      (*grad)[0] = shape;
+      (*grad)[1] = p[0] * (p[3] * dl_dc + (1.0 - p[3]) * dg_dc);
+      (*grad)[2] = p[0] * (p[3] * dl_dc + (1.0 - p[3]) * dg_dc) * d / p[2];
+      (*grad)[3] = p[0] * (l - g);
+    }
+
+    return p[0] * shape;
+  }
+
+  static double sum_of_squares(const Params &p, ::std::span<const double> x, ::std::span<const double> y) {
+    double sse{};
+    for (size_t k{}; k < x.size(); k++) {
+      double r = y[k] - profile_value(p, x[k], nullptr);
+      sse += r * r;
+    }
+
+    return sse;
+  }
+
+  // ---- Solve the n x n system a * out = b by Gaussian elimination with partial pivoting ----
+  static bool solve(::std::array<::std::array<double, 4>, 4> a, Params b, size_t n, Params &out) {
+    for (size_t col{}; col < n; col++) {
+      size_t pivot = col;
+      for (size_t row = col + 1; row < n; row++) {
+	if (::std::abs(a[row][col]) > ::std::abs(a[pivot][col]))
+	  pivot = row;
+      }
+
+      if (a[pivot][col] == 0.0)
+	return false;
+
+      ::std::swap(a[col], a[pivot]);
+      ::std::swap(b[col], b[pivot]);
+      for (size_t row = col + 1; row < n; row++) {
+	double factor = a[row][col] / a[col][col];
+	for (size_t k = col; k < n; k++)
+	  a[row][k] -= factor * a[col][k];
+	b[row] -= factor * b[col];
+      }
+    }
+
+    for (size_t col = n; col-- > 0;) {
+      double sum = b[col];
+      for (size_t k = col + 1; k < n; k++)
+	sum -= a[col][k] * out[k];
+      out[col] = sum / a[col][col];
+    }
+
+    return true;
+  }
+
+  // ---- Levenberg-Marquardt, returns false when the fit doesn't give a usable peak ----
+  static bool levenberg_marquardt(Params &p, size_t n_params, ::std::span<const double> x, ::std::span<const double> y, size_t max_iterations) {
+    double lambda = 1e-3;
+    double sse = sum_of_squares(p, x, y);
+
+    for (size_t it{}; it < max_iterations; it++) {
+      ::std::array<::std::array<double, 4>, 4> jtj{};
+      Params jtr{};
+      for (size_t k{}; k < x.size(); k++) {
+	Params grad;
+	double r = y[k] - profile_value(p, x[k], &grad);
+	for (size_t a{}; a < n_params; a++) {
+	  jtr[a] += grad[a] * r;
+	  for (size_t b{}; b < n_params; b++)
+	    jtj[a][b] += grad[a] * grad[b];
+	}
+      }
+
+      // Raise lambda until a step lowers the error or the step gets too small to matter
+      bool improved{ false };
+      while (lambda < 1e10) {
+	auto damped = jtj;
+	for (size_t a{}; a < n_params; a++)
+	  damped[a][a] += lambda * ::std::max(jtj[a][a], 1e-12);
+
+	Params step{};
+	if (!solve(damped, jtr, n_params, step))
+	  return false;
+
+	Params next = p;
+	for (size_t a{}; a < n_params; a++)
+	  next[a] += step[a];
+	next[2] = ::std::abs(next[2]);
+	next[3] = ::std::clamp(next[3], 0.0, 1.0);
+
+	double next_sse = next[2] > 0.0 ? sum_of_squares(next, x, y) : ::std::numeric_limits<double>::infinity();
+	if (next_sse < sse) {
+	  double change = sse - next_sse;
+	  p = next;
+	  sse = next_sse;
+	  lambda = ::std::max(lambda / 10, 1e-12);
+	  improved = true;
+	  if (change <= CONVERGENCE_TOLERANCE * sse)
+	    return true;
+	  break;
+	}
+
+	lambda *= 10;
+      }
+
+      if (!improved)
+	return true; // no step lowers the error, p is a minimum
+    }
+
+    return true;
+  }
+
+  // ---- Vertex of the parabola through the apex and its neighbours ----
+  static double parabola_vertex(::std::span<const double> mz, ::std::span<const double> signal, size_t apex) {
+    if (apex == 0 || apex + 1 >= signal.size())
+      return mz[apex];
+
+    double left = signal[apex - 1], mid = signal[apex], right = signal[apex + 1];
+    double denom = left - 2.0 * mid + right;
+    if (denom == 0.0)
+      return mz[apex];
+
+    double offset = 0.5 * (left - right) / denom; // in points, within [-0.5, 0.5] for a true maximum
+    double spacing = offset < 0.0 ? mz[apex] - mz[apex - 1] : mz[apex + 1] - mz[apex];
+    return mz[apex] + offset * spacing;
+  }
+
+  // ---- Fit the peak at apex over the points that fall off monotonically on each side of it ----
+  Peak fit_peak(::std::span<const double> mz, ::std::span<const double> signal, size_t apex, const Options &options) {
+    Peak peak{ parabola_vertex(mz, signal, apex), signal[apex], 0.0, 0.0, false };
+
+    size_t lo = apex, hi = apex;
+    while (lo > 0 && apex - lo < options.max_fit_half_width && signal[lo - 1] <= signal[lo] && signal[lo - 1] > 0.0)
+      lo--;
+    while (hi + 1 < signal.size() && hi - apex < options.max_fit_half_width && signal[hi + 1] <= signal[hi] && signal[hi + 1] > 0.0)
+      hi++;
+
+    size_t n_params = options.profile == Profile::PSEUDO_VOIGT ? 4 : 3;
+    size_t n_points = hi - lo + 1;
+    if (n_points < ::std::max(MIN_FIT_POINTS, n_params + 1))
+      return peak;
+
+    double scale = ::std::max(mz[hi] - mz[lo], ::std::numeric_limits<double>::min());
+    ::std::vector<double> x(n_points), y(n_points);
+    for (size_t k{}; k < n_points; k++) {
+      x[k] = (mz[lo + k] - mz[apex]) / scale;
+      y[k] = signal[lo + k];
+    }
+
+    // Starting width from the points above half the apex height
+    size_t above_half{};
+    for (double value: y)
+      above_half += value >= 0.5 * signal[apex];
+    double width = ::std::max(above_half, size_t{ 2 }) * (x.back() - x.front()) / (n_points - 1);
+
+    Params p{ signal[apex], 0.0, width, options.profile == Profile::PSEUDO_VOIGT ? 0.5 : 0.0 };
+    if (!levenberg_marquardt(p, n_params, x, y, options.max_iterations))
+      return peak;
+
+    // A center outside the fitted points or a non physical shape means the fit can't be trusted
+    if (!(p[0] > 0.0 && p[2] > 0.0 && p[1] >= x.front() && p[1] <= x.back()) || !::std::isfinite(p[1]))
+      return peak;
+
+    return { mz[apex] + p[1] * scale, p[0], p[2] * scale, p[3], true };
+  }
+
+  // ---- Detect and fit every peak of a spectrum, in ascending m/z ----
+  ::std::vector<Peak> find_peaks(const Spectrum &spectrum, const Options &options) {
+    if (spectrum.intensity.empty())
+      return {};
+
+    auto signal = subtract_baseline(spectrum.intensity, options.baseline_window);
+    double tallest = *::std::max_element(signal.begin(), signal.end());
+    auto noise = estimate_noise(signal);
+    double min_rise = ::std::max(options.min_snr * noise.sigma, MIN_RELATIVE_HEIGHT * tallest);
+
+    ::std::vector<Peak> peaks;
+    for (auto apex: find_local_maxima(signal, noise.level + min_rise, min_rise, options.baseline_window))
+      peaks.push_back(fit_peak(spectrum.mz, signal, apex, options));
+
+    return peaks;
+  }
+
+  // ------------------
+  // Validation
+  // ------------------
+
+  // ---- Match every reference peak to the closest peak within tolerance_ppm, both lists in ascending m/z ----
+  Comparison compare_peaks(::std::span<const double> reference_mz, ::std::span<const double> peak_mz, double tolerance_ppm) {
+    Comparison comparison{};
+    ::std::vector<bool> used(peak_mz.size(), false);
+    for (double reference: reference_mz) {
+      auto it = ::std::lower_bound(peak_mz.begin(), peak_mz.end(), reference);
+      size_t best = peak_mz.size();
+      double best_ppm = tolerance_ppm;
+      auto consider = [&] (size_t idx) {
+	double ppm = ::std::abs(peak_mz[idx] - reference) / reference * 1e6;
+	if (!used[idx] && ppm <= best_ppm) {
+	  best = idx;
+	  best_ppm = ppm;
+	}
+      };
+
+      // Closest peaks are the one below reference and the first one at or above it
+      size_t upper = it - peak_mz.begin();
+      if (upper > 0)
+	consider(upper - 1);
+      if (upper < peak_mz.size())
+	consider(upper);
+
+      if (best == peak_mz.size()) {
+	comparison.missed++;
+	continue;
+      }
+
+      used[best] = true;
+      comparison.matched++;
+      comparison.max_ppm = ::std::max(comparison.max_ppm, best_ppm);
+    }
+
+    comparison.extra = peak_mz.size() - comparison.matched;
+    return comparison;
+  }
+}
@@ -1,14 +1,72 @@
 #include "Postprocess.h"
-#include <numeric>
 
 using namespace CNum::DataStructs;
 
+// ---- Rank the rows of the m/z groups [group_offsets[g], group_offsets[g + 1]) and pick one page of them ----
+Postprocess::RankedPage Postprocess::rank_preds(const Matrix<double> &preds,
+						const ::std::vector<size_t> &group_offsets,
+						const RankOptions &options) {
+  // Ties keep their row order so every page of a ranking is cut from the same order
+  auto by_score = [&preds] (size_t a, size_t b) {
+    double score_a = preds.get(a, 0), score_b = preds.get(b, 0);
+    return score_a > score_b || (score_a == score_b && a < b);
+  };
+
+  ::std::vector<size_t> ranked;
+  ranked.reserve(group_offsets.empty() ? 0 : group_offsets.back());
+  for (size_t g = 0; g + 1 < group_offsets.size(); g++) {
+    size_t group_start = ranked.size();
+    for (size_t row = group_offsets[g]; row < group_offsets[g + 1]; row++) {
+      if (preds.get(row, 0) >= options.min_score)
+	ranked.push_back(row);
+    }
+
+    // Only the top_k of the group have to be found, not put in order
+    if (options.top_k != 0 && ranked.size() - group_start > options.top_k) {
+      auto kth = ranked.begin() + group_start + options.top_k;
+      ::std::nth_element(ranked.begin() + group_start, kth, ranked.end(), by_score);
+      ranked.erase(kth, ranked.end());
+    }
+  }
+
+  RankedPage page;
+  page.n_ranked = ranked.size();
+  size_t page_start = ::std::min(options.offset, ranked.size());
+  size_t page_end = options.page_size == 0 ? ranked.size() : ::std::min(page_start + options.page_size, ranked.size());
+  page.next_offset = page_end;
+
+  // Rows past the end of the page are never sorted
+  ::std::partial_sort(ranked.begin(), ranked.begin() + page_end, ranked.end(), by_score);
+  page.rows.assign(ranked.begin() + page_start, ranked.begin() + page_end);
+  return page;
+}
+
 // ---- Sort the the prediction values and the compound they represent by the prediction values ----
-void Postprocess::sort_preds(Matrix<double> &encoded_compounds,
+void Postprocess::sort_preds(Chem::CompoundList &encoded_compounds,
 			     Matrix<double> &preds,
 			     Matrix<double> &ppms) {
-  auto mask = preds.argsort(true);
-  preds = preds[mask];
-  encoded_compounds = encoded_compounds[mask];
-  ppms = ppms[mask];
+  size_t n_rows = encoded_compounds.size();
+  RankOptions options;
+  options.min_score = -::std::numeric_limits<double>::infinity();
+  auto order = rank_preds(preds, { 0, n_rows }, options).rows;
+
+  // NaN scores don't pass any min_score, they go last in row order
+  for (size_t row{}; row < n_rows && order.size() < n_rows; row++) {
+    if (::std::isnan(preds.get(row, 0)))
+      order.push_back(row);
+  }
+
+  auto sorted_preds = ::std::make_unique<double[]>(n_rows);
+  auto sorted_ppms = ::std::make_unique<double[]>(n_rows);
+  Chem::CompoundList sorted;
+  sorted.reserve(n_rows);
+  for (size_t i{}; i < n_rows; i++) {
+    sorted_preds[i] = preds.get(order[i], 0);
+    sorted_ppms[i] = ppms.get(order[i], 0);
+    sorted.push_back(encoded_compounds[order[i]]);
+  }
+
+  preds = Matrix<double>(n_rows, 1, ::std::move(sorted_preds));
+  ppms = Matrix<double>(n_rows, 1, ::std::move(sorted_ppms));
+  encoded_compounds = ::std::move(sorted);
 }
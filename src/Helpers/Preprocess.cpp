@@ -9,243 +9,525 @@ using namespace Chem;
 // -----------------------
 
 namespace Preprocess {
-  // ---- Turn compound string into an encoded compound ----
-  Matrix<double> encode_compounds(const ::std::vector<unenc_compound> &compound_strings) {
-    size_t ec_size = compound_strings.size() * TOTAL_CHEMS;
-    auto encoded_compounds_ptr = ::std::make_unique<double[]>(ec_size);
-    ::std::fill(encoded_compounds_ptr.get(), encoded_compounds_ptr.get() + ec_size, 0.0);
+  // ---- Index of a one or two letter element symbol, TOTAL_CHEMS if it isn't one SoarAI tracks ----
+  static uint8_t element_idx(char first, char second) {
+    switch (first) {
+    case 'H': return second == '\0' ? ChemIdx::H : TOTAL_CHEMS;
+    case 'C': return second == '\0' ? ChemIdx::C : (second == 'l' ? ChemIdx::Cl : TOTAL_CHEMS);
+    case 'N': return second == '\0' ? ChemIdx::N : TOTAL_CHEMS;
+    case 'O': return second == '\0' ? ChemIdx::O : TOTAL_CHEMS;
+    case 'F': return second == '\0' ? ChemIdx::F : TOTAL_CHEMS;
+    case 'S': return second == '\0' ? ChemIdx::S : (second == 'i' ? ChemIdx::Si : TOTAL_CHEMS);
+    default: return TOTAL_CHEMS;
+    }
+  }
 
-    auto *cm = ChemMap::get_chem_map();
+  [[noreturn]] static void throw_malformed(::std::string_view formula, size_t pos, const char *what) {
+    throw ::std::runtime_error("Encode compounds error -- " + ::std::string(what) + " at position " + ::std::to_string(pos)
+			       + " of " + ::std::string(formula));
+  }
 
-    size_t comp_ctr = 0;
-    for (auto compound: compound_strings) {
-      auto open_per_it = compound.val.begin();
-    
-      while ((open_per_it = ::std::find(compound.val.begin(), compound.val.end(), '(')) != compound.val.end()) {
-	auto end_per_it = ::std::find(open_per_it, compound.val.end(), ')');
-	::std::string polyatomic = { open_per_it + 1, end_per_it };
-
-	auto after_polyatomic = end_per_it + 1;
-	::std::string num{""};
-	while (after_polyatomic != compound.val.end() && ::std::isdigit(static_cast<unsigned char>(*after_polyatomic)) != 0) {
-	  num += *after_polyatomic;
-	  after_polyatomic++;
-	}
+  // ---- Read the count after a symbol (1 if there is none), pos is left after the digits ----
+  static uint16_t parse_count(::std::string_view formula, size_t &pos) {
+    size_t digits_start = pos;
+    uint32_t count{};
+    while (pos < formula.size() && formula[pos] >= '0' && formula[pos] <= '9') {
+      count = count * 10 + (formula[pos] - '0');
+      if (count > ::std::numeric_limits<uint16_t>::max())
+	throw_malformed(formula, digits_start, "count out of range");
+      pos++;
+    }
+
+    return pos == digits_start ? 1 : static_cast<uint16_t>(count);
+  }
 
-	size_t idx = comp_ctr * TOTAL_CHEMS + cm->get_idx(polyatomic);
-	encoded_compounds_ptr[idx] = (num == "" ? 1 : stoi(num)) *  CHEM_SCALE_FACTOR;
-	compound.val = { end_per_it, compound.val.end() };
+  /* ---- Turn a compound string into an encoded compound in one pass without allocating ----
+     Elements are 1-2 letter symbols, polyatomics are written in parentheses, i.e. (NH4)H2O. A symbol that
+     shows up twice keeps its last count, and charge signs are skipped */
+  Compound encode_compound(::std::string_view formula) {
+    Compound encoded_compound;
+    size_t pos{};
+
+    while (pos < formula.size()) {
+      char c = formula[pos];
+      size_t symbol_pos = pos;
+
+      if (c == '(') {
+	auto close = formula.find(')', pos + 1);
+	if (close == ::std::string_view::npos)
+	  throw_malformed(formula, symbol_pos, "unclosed '('");
+
+	auto idx = ::Chem::find_chem_idx(formula.substr(pos + 1, close - pos - 1));
+	if (idx == TOTAL_CHEMS)
+	  throw_malformed(formula, symbol_pos, "unknown polyatomic");
+
+	pos = close + 1;
+	encoded_compound[idx] = parse_count(formula, pos);
+      } else if (c >= 'A' && c <= 'Z') {
+	char second = pos + 1 < formula.size() && formula[pos + 1] >= 'a' && formula[pos + 1] <= 'z' ? formula[pos + 1] : '\0';
+	auto idx = element_idx(c, second);
+	if (idx == TOTAL_CHEMS)
+	  throw_malformed(formula, symbol_pos, "unknown element");
+
+	pos += second == '\0' ? 1 : 2;
+	encoded_compound[idx] = parse_count(formula, pos);
+      } else if (c == '+' || c == '-') {
+	pos++;
+      } else {
+	throw_malformed(formula, symbol_pos, "unexpected character");
       }
+    }
 
-      for (int i{}; i < compound.val.size(); i++) {
-	::std::string chemical;
-	chemical.push_back(compound.val[i]);
-	if (i < compound.val.size() - 1 && ::std::islower(static_cast<unsigned char>(compound.val[i + 1])) != 0) {
-	  chemical += compound.val[i + 1];
-	}
+    return encoded_compound;
+  }
 
-	if (::std::isupper(static_cast<unsigned char>(chemical[0])) == 0) {
-	  continue;
-	}
+  Compound encode_compound(const unenc_compound &compound_string) {
+    return encode_compound(::std::string_view(compound_string.val));
+  }
 
-	::std::string num{""};
-	for (int j = i + chemical.size(); j < compound.val.size(); j++) {
-	  if (::std::isdigit(static_cast<unsigned char>(compound.val[j])
-			     ) == 0) {
-	    break;
-	  }
+  // ---- Turn compound strings into encoded compounds, large lists are split across the thread pool ----
+  CompoundList encode_compounds(const ::std::vector<unenc_compound> &compound_strings) {
+    CompoundList encoded_compounds(compound_strings.size());
+    size_t n_chunks = ::std::min<size_t>(::std::max(::std::thread::hardware_concurrency(), 1u),
+					 (compound_strings.size() + MIN_ENCODE_CHUNK_SIZE - 1) / MIN_ENCODE_CHUNK_SIZE);
 
-	  num += compound.val[j];
-	}
+    auto encode_range = [&compound_strings, &encoded_compounds] (size_t start, size_t end) {
+      for (size_t i = start; i < end; i++)
+	encoded_compounds[i] = encode_compound(compound_strings[i]);
 
-	if (num == "") {
-	  num = "1";
-	}
+      return end - start;
+    };
 
-	double val;
-	try {
-	  val = stof(num) * CHEM_SCALE_FACTOR;
-	} catch(...) {
-	  throw ::std::runtime_error("Encode compounds error -- converting " + num + " to string");
-	}
-	encoded_compounds_ptr[comp_ctr * TOTAL_CHEMS + cm->get_idx(chemical)] = val;
-      }
+    if (n_chunks <= 1) {
+      encode_range(0, compound_strings.size());
+      return encoded_compounds;
+    }
+
+    ::std::vector< ::std::future<size_t> > workers;
+    workers.reserve(n_chunks);
+    auto *tp = ThreadPool::get_thread_pool();
+    size_t chunk_size = (compound_strings.size() + n_chunks - 1) / n_chunks;
 
-      comp_ctr++;
+    for (size_t start{}; start < compound_strings.size(); start += chunk_size) {
+      size_t end = ::std::min(start + chunk_size, compound_strings.size());
+      workers.push_back(tp->submit< size_t >([&encode_range, start, end] (arena_t *arena) { return encode_range(start, end); }));
     }
+
+    // get() on every worker before rethrowing so none of them outlive the output
+    ::std::exception_ptr error;
+    for (auto &worker: workers) {
+      try {
+	worker.get();
+      } catch (...) {
+	if (!error)
+	  error = ::std::current_exception();
+      }
+    }
+
+    if (error)
+      ::std::rethrow_exception(error);
   
-    return Matrix<double>(compound_strings.size(), TOTAL_CHEMS, ::std::move(encoded_compounds_ptr));
-  }
-
-  // ---- Recursive function for finding all possible elemental combos with a total mass close to the m/z ----
-  void all_possible_el_recurse(::std::vector< ::std::vector<size_t> > &res,
-			       ::std::vector<double> &theoretical_compound_masses,
-			       const ::std::vector<double> &masses,
-			       ::std::vector<size_t> &temp,
-			       const ReagantIonMask &mask,
-			       double mass,
-			       double target_mass,
-			       size_t idx = 0) {
-    constexpr double pruning_tolerance = 1.5;
-    constexpr double ppm_tolerance = 50;
-  
-    double theoretical_mass = target_mass - mass;
+    return encoded_compounds;
+  }
 
-    if (::std::abs(Chem::get_ppm(target_mass, theoretical_mass)) <= ppm_tolerance) {    
-      res.push_back(temp);
-      theoretical_compound_masses.push_back(theoretical_mass);
+  // ---- Branch and bound search for all elemental combos with a total mass close to the m/z ----
+  static void enumerate_elemental_combos(CompoundList &res,
+					 ::std::vector<double> &theoretical_compound_masses,
+					 const ::std::array<double, TOTAL_CHEMS> &masses,
+					 const ReagantIonMask &mask,
+					 double target_mass) {
+    constexpr double ppm_tolerance = ::CandidateIndex::PPM_TOLERANCE;
+    const size_t n_el = mask.length;
+    if (n_el == 0 || target_mass <= 0.0)
       return;
+
+    // Window of theoretical masses within the ppm tolerance, padded for rounding (exact check at the leaves)
+    const double low = target_mass / (1 + ppm_tolerance * 1e-6) * (1 - 1e-12);
+    const double high = target_mass / (1 - ppm_tolerance * 1e-6) * (1 + 1e-12);
+
+    ::std::array<double, TOTAL_CHEMS> el_masses;
+    ::std::array<double, TOTAL_CHEMS + 1> min_suffix_mass; // lightest element at or after each position
+    min_suffix_mass[n_el] = ::std::numeric_limits<double>::infinity();
+    for (size_t p = n_el; p-- > 0;) {
+      el_masses[p] = masses[mask.indeces[p]];
+      min_suffix_mass[p] = ::std::min(el_masses[p], min_suffix_mass[p + 1]);
     }
-  
-    for (int i = idx; i < mask.length; i++) {
-      if (mass - masses[mask.indeces[i]] <= -pruning_tolerance) {
+
+    // Explicit stack: counts of every mask element and the mass of the elements before each position
+    ::std::array<uint32_t, TOTAL_CHEMS> counts{};
+    ::std::array<double, TOTAL_CHEMS + 1> partial_mass{};
+    const size_t last = n_el - 1;
+
+    auto emit = [&] (uint32_t last_count, double theoretical_mass) {
+      auto &compound = res.emplace_back();
+      for (size_t p{}; p < last; p++)
+	compound[mask.indeces[p]] = counts[p];
+      compound[mask.indeces[last]] = last_count;
+      theoretical_compound_masses.push_back(theoretical_mass);
+    };
+
+    // Largest count of the element at a position that keeps the mass under the window (upper bound)
+    auto max_count = [&] (size_t p) -> uint32_t {
+      double room = high - partial_mass[p];
+      return room < 0.0 ? 0 : static_cast<uint32_t>(room / el_masses[p]);
+    };
+
+    /* Counts are walked from high to low at every position so the combos come out in the same order
+       as the old recursive search (lexicographic in the sorted element sequence) */
+    size_t pos = 0;
+    counts[0] = max_count(0);
+    while (true) {
+      if (pos == last) {
+	// Only the count of the last element is free, so solve for the counts that land in the window
+	double base = partial_mass[last];
+	double m = el_masses[last];
+	uint32_t hi = max_count(last);
+	double lo_needed = (low - base) / m;
+	uint32_t lo = lo_needed <= 0.0 ? 0 : static_cast<uint32_t>(::std::ceil(lo_needed));
+
+	for (uint32_t c = hi + 1; c-- > lo;) {
+	  double theoretical_mass = c == 0 ? base : base + m * c;
+	  if (theoretical_mass > 0.0 && ::std::abs(Chem::get_ppm(target_mass, theoretical_mass)) <= ppm_tolerance)
+	    emit(c, theoretical_mass);
+	}
+
+	// Backtrack to the deepest position that can still be decremented
+	do {
+	  if (pos == 0)
+	    return;
+	  pos--;
+	} while (counts[pos] == 0);
+	counts[pos]--;
+      }
+
+      double mass = counts[pos] == 0 ? partial_mass[pos] : partial_mass[pos] + el_masses[pos] * counts[pos];
+
+      /* Lower bound: unless the mass is already in the window the remaining elements have to add at least
+	 the lightest of them, if that overshoots try a smaller count here */
+      if (mass < low && mass + min_suffix_mass[pos + 1] > high) {
+	if (counts[pos] > 0) {
+	  counts[pos]--;
+	  continue;
+	}
+
+	do {
+	  if (pos == 0)
+	    return;
+	  pos--;
+	} while (counts[pos] == 0);
+	counts[pos]--;
 	continue;
       }
-    
-      temp.push_back(mask.indeces[i]);
-      all_possible_el_recurse(res,
-			      theoretical_compound_masses,
-			      masses,
-			      temp,
-			      mask,
-			      mass - masses[mask.indeces[i]],
-			      target_mass,
-			      i);
-      temp.pop_back();
+
+      partial_mass[pos + 1] = mass;
+      pos++;
+      counts[pos] = pos == last ? 0 : max_count(pos);
+    }
+  }
+
+  // ---- Look up all possible elemental combos with a total mass close to the m/z in a prebuilt index ----
+  static CompoundPermutations index_elemental_combo(const ::CandidateIndex::MassIndex &index, double mass) {
+    ::std::vector<size_t> hits;
+    index.query(mass, hits);
+
+    const auto &elements = index.get_elements();
+    CompoundList encoded_compounds(hits.size());
+    ::std::vector<double> theoretical_compound_masses;
+    theoretical_compound_masses.reserve(hits.size());
+
+    for (size_t j{}; j < hits.size(); j++) {
+      auto counts = index.get_counts(hits[j]);
+      for (size_t k{}; k < elements.size(); k++) {
+	encoded_compounds[j][elements[k]] = counts[k];
+      }
+
+      theoretical_compound_masses.push_back(index.get_mass(hits[j]));
     }
+
+    return { ::std::move(encoded_compounds), ::std::move(theoretical_compound_masses) };
   }
 
   // ---- Find all possible elemental combos with a total mass close to the m/z ----
-  CompoundPermutations all_possible_elemental_combo(double mass, unenc_compound reagant_ion) {
+  CompoundPermutations all_possible_elemental_combo(double mass, ReagantIon reagant_ion) {
+    const auto *index = ::CandidateIndex::get_index(reagant_ion);
+    if (index != nullptr && index->covers(mass))
+      return index_elemental_combo(*index, mass);
+
     auto *cm = ChemMap::get_chem_map();
     const auto &masses = cm->get_masses();
     const auto &mask = cm->get_reagant_ion_mask(reagant_ion);
     
-    ::std::vector<size_t> temp;
+    CompoundList res;
     ::std::vector<double> theoretical_compound_masses;
-    ::std::vector< ::std::vector<size_t> > res;
-
-    all_possible_el_recurse(res,
-			    theoretical_compound_masses,
-			    masses,
-			    temp,
-			    mask,
-			    mass,
-			    mass);
-  
-    auto encoded_compounds = ::std::make_unique<double[]>(TOTAL_CHEMS * res.size());
-  
-    for (int i{}; i < TOTAL_CHEMS; i++) {
-      for (int j = 0; j < res.size(); j++) {
-	encoded_compounds[j * TOTAL_CHEMS + i] = static_cast<double>(::std::count(res[j].begin(), res[j].end(), i))  * CHEM_SCALE_FACTOR;
-      }
-    }
+
+    enumerate_elemental_combos(res,
+			       theoretical_compound_masses,
+			       masses,
+			       mask,
+			       mass);
   
-    return { Matrix<double>(res.size(), TOTAL_CHEMS, ::std::move(encoded_compounds)),
-	     ::std::move(theoretical_compound_masses) };
+    return { ::std::move(res), ::std::move(theoretical_compound_masses) };
   }
 
-  // ---- Take encoded compounds and decode them back into strings ----
-  ::std::vector<unenc_compound> decode_compounds(const Matrix<double> &encoded_compounds) {
-    ::std::vector<unenc_compound> decoded_compounds;
-    decoded_compounds.reserve(encoded_compounds.get_rows());
-    
-    auto *cm = ChemMap::get_chem_map();
-    const auto &chems = cm->get_chems();
-    const auto &proper_order = cm->get_proper_ordering();
-
-    for (int i{}; i < encoded_compounds.get_rows(); i++) {
-      ::std::string compound_str{""};
-      for (int j = 0; j < TOTAL_CHEMS; j++) {
-	uint8_t idx = proper_order[j];
-	double num_el_j = encoded_compounds.get(i, idx);
-	if (num_el_j > 0) {
-	  // Check if chem is a polyatomic (if its length is > 2)
-	  if (chems[idx].size() > 2) {
-	    compound_str += "(" + chems[idx] + ")";
-	    continue;
-	  }
-	
-	  compound_str += chems[idx];
-	  if (num_el_j > CHEM_SCALE_FACTOR) {
-	    compound_str += ::std::to_string((uint32_t) (num_el_j / CHEM_SCALE_FACTOR));
-	  }
-	}
-      }
+  // ---------------------
+  // Formula Arena
+  // ---------------------
 
-      decoded_compounds.emplace_back(compound_str);
-    }
-  
-    return decoded_compounds;
+  void FormulaArena::reserve(size_t n_formulas, size_t n_chars) {
+    _ends.reserve(n_formulas);
+    if (n_chars <= _capacity)
+      return;
+
+    auto chars = ::std::make_unique<char[]>(n_chars);
+    if (_used != 0)
+      ::std::memcpy(chars.get(), _chars.get(), _used);
+    _chars = ::std::move(chars);
+    _capacity = n_chars;
   }
 
-  // ---- Take out polyatomics from encoded compound and adjust the polyatomic chemicals accordingly ----
-  Matrix<double> simplify_compounds(const Matrix<double> &unsimplified_compounds) {
-    uint32_t n_compounds = unsimplified_compounds.get_rows();
+  void FormulaArena::clear() {
+    _used = 0;
+    _ends.clear();
+  }
 
-    size_t simplified_size = n_compounds * TOTAL_CHEMS;
-    auto simplified_ptr = ::std::make_unique<double[]>(simplified_size);
-    ::std::fill(simplified_ptr.get(), simplified_ptr.get() + simplified_size, 0.0);
+  size_t FormulaArena::size() const {
+    return _ends.size();
+  }
 
-    auto *cm = ChemMap::get_chem_map();
-    const auto &chems = cm->get_chems();
+  // ---- View of formula i, only valid until the next formula is added ----
+  ::std::string_view FormulaArena::operator[](size_t i) const {
+    size_t start = i == 0 ? 0 : _ends[i - 1];
+    return { _chars.get() + start, _ends[i] - start };
+  }
 
-    ::std::vector<unenc_compound> polyatomics;
+  // ---- Room for the next formula, end_formula commits the first len characters of it ----
+  char *FormulaArena::begin_formula(size_t max_len) {
+    if (_used + max_len > _capacity)
+      reserve(_ends.size() + 1, ::std::max(_capacity * 2, _used + max_len));
 
-    for (size_t i = POLYATOMIC_START_IDX; i < TOTAL_CHEMS; i++) {
-      polyatomics.emplace_back(chems[i]);
+    return _chars.get() + _used;
+  }
+
+  void FormulaArena::end_formula(size_t len) {
+    _used += len;
+    _ends.push_back(_used);
+  }
+
+  // ---------------------
+  // Decoding
+  // ---------------------
+
+  struct FormulaFragment {
+    char text[8];
+    uint8_t len;
+    bool is_polyatomic; // polyatomics are written in parentheses without a count
+  };
+
+  // ---- Text of every chemical, indexed like a Compound ----
+  static constexpr auto DECODE_FRAGMENTS = [] {
+    ::std::array<FormulaFragment, TOTAL_CHEMS> fragments{};
+    for (size_t idx{}; idx < TOTAL_CHEMS; idx++) {
+      auto symbol = CHEM_SYMBOLS[idx];
+      auto &fragment = fragments[idx];
+      fragment.is_polyatomic = idx >= POLYATOMIC_START_IDX;
+
+      if (fragment.is_polyatomic)
+	fragment.text[fragment.len++] = '(';
+      for (char c: symbol)
+	fragment.text[fragment.len++] = c;
+      if (fragment.is_polyatomic)
+	fragment.text[fragment.len++] = ')';
     }
 
-    auto polyatomics_encoded = encode_compounds(polyatomics);
+    return fragments;
+  }();
+
+  // ---- "00" to "99", counts in compounds are almost always below 100 ----
+  static constexpr auto DIGIT_PAIRS = [] {
+    ::std::array<char, 200> pairs{};
+    for (size_t n{}; n < 100; n++) {
+      pairs[n * 2] = static_cast<char>('0' + n / 10);
+      pairs[n * 2 + 1] = static_cast<char>('0' + n % 10);
+    }
+
+    return pairs;
+  }();
+
+  static char *write_count(char *out, uint16_t count) {
+    if (count < 10) {
+      *out = static_cast<char>('0' + count);
+      return out + 1;
+    }
+
+    if (count < 100) {
+      ::std::memcpy(out, DIGIT_PAIRS.data() + count * 2, 2);
+      return out + 2;
+    }
+
+    return ::std::to_chars(out, out + 5, count).ptr;
+  }
+
+  // ---- Write a formula in the standard chemical order, returns its length ----
+  static size_t format_formula(const Compound &compound, char *out) {
+    char *pos = out;
+    for (auto idx: PROPER_ORDERING) {
+      uint16_t count = compound[idx];
+      if (count == 0)
+	continue;
 
-    for (size_t i{}; i < n_compounds; i++) {
-      for (int j = 0; j < POLYATOMIC_START_IDX; j++) {
-	simplified_ptr[i * TOTAL_CHEMS + j] = unsimplified_compounds.get(i, j);
+      const auto &fragment = DECODE_FRAGMENTS[idx];
+      ::std::memcpy(pos, fragment.text, fragment.len);
+      pos += fragment.len;
+
+      if (!fragment.is_polyatomic && count > 1)
+	pos = write_count(pos, count);
+    }
+
+    return pos - out;
+  }
+
+  // ---- Decode compounds into arenas, the simplified formulas come from the same pass (either can be nullptr) ----
+  void decode_compounds(::std::span<const Compound> encoded_compounds, FormulaArena *decoded, FormulaArena *decoded_simplified) {
+    constexpr size_t typical_formula_len = 16;
+    for (auto *arena: { decoded, decoded_simplified }) {
+      if (arena != nullptr) {
+	arena->clear();
+	arena->reserve(encoded_compounds.size(), encoded_compounds.size() * typical_formula_len);
       }
-    
-      for (size_t j = POLYATOMIC_START_IDX; j < TOTAL_CHEMS; j++) {
-	double n_poly = unsimplified_compounds.get(i, j);
-	if (n_poly > 0.0) {
-	  auto poly_j = polyatomics_encoded.get(ROW, j - POLYATOMIC_START_IDX) * ::std::round(n_poly / CHEM_SCALE_FACTOR);
-	  for (int k = 0; k < TOTAL_CHEMS; k++) {
-	    simplified_ptr[i * TOTAL_CHEMS + k] += poly_j.get(k, 0);
-	  }
-	}
+    }
+
+    for (const auto &compound: encoded_compounds) {
+      if (decoded != nullptr)
+	decoded->end_formula(format_formula(compound, decoded->begin_formula(MAX_FORMULA_LEN)));
+
+      if (decoded_simplified != nullptr) {
+	auto simplified = compound;
+	Chem::simplify_compound(simplified);
+	decoded_simplified->end_formula(format_formula(simplified, decoded_simplified->begin_formula(MAX_FORMULA_LEN)));
       }
     }
+  }
+
+  // ---- Take encoded compounds and decode them back into strings ----
+  ::std::vector<unenc_compound> decode_compounds(const CompoundList &encoded_compounds) {
+    FormulaArena arena;
+    decode_compounds(encoded_compounds, &arena);
+
+    ::std::vector<unenc_compound> decoded_compounds;
+    decoded_compounds.reserve(encoded_compounds.size());
+    for (size_t i{}; i < arena.size(); i++)
+      decoded_compounds.emplace_back(::std::string(arena[i]));
+  
+    return decoded_compounds;
+  }
+
+  // ---- Take out polyatomics from encoded compound and adjust the polyatomic chemicals accordingly ----
+  CompoundList simplify_compounds(const CompoundList &unsimplified_compounds) {
+    CompoundList simplified(unsimplified_compounds);
+    Chem::simplify_compounds_in_place(simplified);
+    return simplified;
+  }
 
-    return Matrix<double>(n_compounds, TOTAL_CHEMS, ::std::move(simplified_ptr));
+  // ---- Write the model data row of an (unsimplified) candidate compound ----
+  static void write_model_row(const Compound &permutation,
+			      uint8_t crit_bits,
+			      double ppm,
+			      double *row,
+			      size_t n_features) {
+    for (int k{}; k < N_CRITEREA; k++)
+      row[k] = (crit_bits >> k) & 1;
+
+    Chem::write_features(permutation, row + N_CRITEREA);
+    row[n_features - 1] = ppm;
   }
 
   // ---- Prepare data for training and inference ----
-  MSData mz_to_data(double mz, unenc_compound ion, size_t n_features) {
+  MSData mz_to_data(double mz, ReagantIon ion, size_t n_features) {
     auto apc = all_possible_elemental_combo(mz, ion);
   
-    apc.compounds = Chem::factor_polyatomics(apc.compounds);
+    Chem::factor_polyatomics_in_place(apc.compounds);
     auto *all_possible_compounds = &apc.compounds;
     auto *theoretical_masses = &apc.masses;
-    size_t total_possible_compounds = all_possible_compounds->get_rows();
+    size_t total_possible_compounds = all_possible_compounds->size();
 
     auto data = ::std::make_unique<double[]>(total_possible_compounds * n_features);
     auto ppms = ::std::make_unique<double[]>(total_possible_compounds);
+    ::std::vector<uint8_t> crit_bits(total_possible_compounds);
+    Chem::get_criterea_bits_batch(*all_possible_compounds, crit_bits.data());
+    Chem::get_ppms(mz, *theoretical_masses, ppms.get());
       
     for (size_t j = 0; j < total_possible_compounds; j++) {
-      auto permutation_matrix = all_possible_compounds->get(ROW, j);
-      auto crit_check = Chem::check_criterea(permutation_matrix);
-
-      auto permutation = permutation_matrix.move_ptr();
-      auto *crit_mask = &crit_check.crit_mask;
-      ::std::move(crit_mask->begin(), crit_mask->end(), data.get() + (j * n_features));
-      ::std::move(permutation.get(), permutation.get() + TOTAL_CHEMS, data.get() + (j * n_features + N_CRITEREA));
-      
-      double ppm = Chem::get_ppm(mz, theoretical_masses->at(j));
-      data[j * n_features + n_features - 1] = ppm;
-      ppms[j] = ppm;
+      write_model_row((*all_possible_compounds)[j],
+		      crit_bits[j],
+		      ppms[j],
+		      data.get() + (j * n_features),
+		      n_features);
     }
 
     return { Matrix<double>(total_possible_compounds, n_features, ::std::move(data)),
 	     ::std::move(apc.compounds),
-	     Matrix<double>(total_possible_compounds, 1, ::std::move(ppms)) };
+	     Matrix<double>(total_possible_compounds, 1, ::std::move(ppms)),
+	     ::std::move(apc.masses) };
+  }
+
+  // ---- Prepare data for many m/z values at once into single contiguous matrices ----
+  MSBatchData mz_to_data_batch(::std::span<const double> mz_values, ReagantIon ion, size_t n_features) {
+    MSBatchData res;
+    res.mz_idx.reserve(mz_values.size());
+
+    // Repeated m/z values share the rows of their first occurrence
+    ::std::unordered_map<double, size_t> seen;
+    for (double mz: mz_values) {
+      auto [it, inserted] = seen.try_emplace(mz, res.mz.size());
+      if (inserted)
+	res.mz.push_back(mz);
+      res.mz_idx.push_back(it->second);
+    }
+
+    // Count pass: enumerate every distinct m/z once to size the output
+    ::std::vector<CompoundPermutations> apcs;
+    apcs.reserve(res.mz.size());
+    res.row_offsets.reserve(res.mz.size() + 1);
+    res.row_offsets.push_back(0);
+
+    for (double mz: res.mz) {
+      apcs.push_back(all_possible_elemental_combo(mz, ion));
+      res.row_offsets.push_back(res.row_offsets.back() + apcs.back().compounds.size());
+    }
+
+    size_t total_rows = res.row_offsets.back();
+    auto data = ::std::make_unique<double[]>(total_rows * n_features);
+    auto ppms = ::std::make_unique<double[]>(total_rows);
+    res.encoded_compounds.reserve(total_rows);
+    res.theoretical_masses.reserve(total_rows);
+
+    // Fill pass: write every candidate straight into its final row
+    ::std::vector<uint8_t> crit_bits;
+    for (size_t i{}; i < res.mz.size(); i++) {
+      auto &compounds = apcs[i].compounds;
+      Chem::factor_polyatomics_in_place(compounds);
+      const auto &theoretical_masses = apcs[i].masses;
+      size_t offset = res.row_offsets[i];
+      crit_bits.resize(compounds.size());
+      Chem::get_criterea_bits_batch(compounds, crit_bits.data());
+      Chem::get_ppms(res.mz[i], theoretical_masses, ppms.get() + offset);
+
+      for (size_t j{}; j < compounds.size(); j++) {
+	write_model_row(compounds[j],
+			crit_bits[j],
+			ppms[offset + j],
+			data.get() + ((offset + j) * n_features),
+			n_features);
+      }
+
+      res.encoded_compounds.insert(res.encoded_compounds.end(), compounds.begin(), compounds.end());
+      res.theoretical_masses.insert(res.theoretical_masses.end(), theoretical_masses.begin(), theoretical_masses.end());
+      apcs[i] = {};
+    }
+
+    res.model_data = Matrix<double>(total_rows, n_features, ::std::move(data));
+    res.ppms = Matrix<double>(total_rows, 1, ::std::move(ppms));
+    return res;
   }
 
   // ------------------
@@ -254,60 +536,248 @@ namespace Preprocess {
 
   // ---- Go through peak list and collect compound strings and m/z values ----
   PeakListData PrepareDataset::parse_peak_list(::std::string path) {
-    ::std::ifstream istream(path);
+    ::FileUtils::MappedFile file(path);
+    auto text = file.view();
+    ::FileUtils::next_line(text); // headers
+
+    constexpr uint8_t ion_col = 2, x0_col = 3;
+    auto chunks = ::FileUtils::split_into_chunks(text, ::std::max(::std::thread::hardware_concurrency(), 1u));
 
-    if (!istream.is_open()) {
-      throw ::std::runtime_error("Parse peak list error - opening file failed");
+    ::std::vector< ::std::future<PeakListData> > workers;
+    workers.reserve(chunks.size());
+    auto *tp = ThreadPool::get_thread_pool();
+
+    for (auto chunk: chunks) {
+      workers.push_back(tp->submit< PeakListData >([chunk] (arena_t *arena) mutable {
+	PeakListData res;
+	while (!chunk.empty()) {
+	  auto line = ::FileUtils::next_line(chunk);
+	  auto x0_field = ::FileUtils::get_field(line, x0_col);
+
+	  double x0;
+	  if (!::FileUtils::parse_double(x0_field, x0))
+	    throw ::std::runtime_error("Parse peak list error -- converting " + ::std::string(x0_field) + " to double");
+
+	  res.mz.push_back(x0);
+	  res.compound_strings.push_back({ ::std::string(::FileUtils::get_field(line, ion_col)) });
+	}
+
+	return res;
+      }));
+    }
+
+    // get() on every worker before rethrowing, they all read from the mapped file
+    ::std::vector<PeakListData> chunk_results;
+    chunk_results.reserve(workers.size());
+    ::std::exception_ptr error;
+    for (auto &worker: workers) {
+      try {
+	chunk_results.push_back(worker.get());
+      } catch (...) {
+	if (!error)
+	  error = ::std::current_exception();
+      }
     }
 
-    constexpr uint8_t ion_col = 3, x0_col = 4;
-    ::std::vector<double> x0;
-    ::std::vector<unenc_compound> assigned_formulas;
+    if (error)
+      ::std::rethrow_exception(error);
 
-    ::std::string line;
-    getline(istream, line, '\n');
-    while (getline(istream, line, '\n')) {
-      ::std::stringstream ss(line);
-      ::std::string segment;
-      for (int i{}; i < ion_col; i++) {
-	getline(ss, segment, '\t');
+    // Concatenate in chunk order so rows stay in file order
+    PeakListData res;
+    for (auto &chunk_data: chunk_results) {
+      res.mz.insert(res.mz.end(), chunk_data.mz.begin(), chunk_data.mz.end());
+      res.compound_strings.insert(res.compound_strings.end(),
+				  ::std::make_move_iterator(chunk_data.compound_strings.begin()),
+				  ::std::make_move_iterator(chunk_data.compound_strings.end()));
+    }
+
+    return res;
+  }
+
+  // ---- One chunk of peaks, its csv rows are the bytes [offset, offset + n_bytes) of its thread's shard ----
+  struct ComboChunk {
+    size_t shard{};
+    size_t offset{};
+    size_t n_bytes{};
+    ::std::string unidentified;
+    ::ComboFile::Rows rows;
+    size_t n_samples{};
+  };
+
+  // ---- Format a combo file row the way ::std::to_string would, without allocating ----
+  static size_t format_combo_row(char *row, uint8_t crit_bits, const Compound &compound, double ppm, bool label) {
+    char *pos = row;
+    char *end = row + PrepareDataset::MAX_COMBO_ROW_LEN;
+    auto append_chars = [&pos, end] (::std::to_chars_result res) {
+      if (res.ec != ::std::errc() || res.ptr == end)
+	throw ::std::runtime_error("Combo file creation error -- row doesn't fit in MAX_COMBO_ROW_LEN");
+
+      pos = res.ptr;
+      *pos++ = ',';
+    };
+
+    for (int k{}; k < N_CRITEREA; k++)
+      append_chars(::std::to_chars(pos, end, (crit_bits >> k) & 1));
+
+    for (int k{}; k < TOTAL_CHEMS; k++)
+      append_chars(::std::to_chars(pos, end, Chem::count_to_feature(compound[k]), ::std::chars_format::fixed, 6));
+
+    append_chars(::std::to_chars(pos, end, ppm, ::std::chars_format::fixed, 6));
+    append_chars(::std::to_chars(pos, end, static_cast<int>(label)));
+    pos[-1] = '\n';
+
+    return pos - row;
+  }
+
+  // ---- Prepare the rows of the peaks in [start, end), csv rows go to the shard ----
+  static void fill_combo_chunk(ComboChunk &chunk,
+			       size_t start,
+			       size_t end,
+			       ::Chem::ReagantIon reagant_ion,
+			       const PeakListData &peak_list_data,
+			       const CompoundList &encoded_unsimplified,
+			       const CompoundList &encoded_simplified,
+			       ::FileUtils::BlockWriter *shard) {
+    auto *cm = ChemMap::get_chem_map();
+    const auto &x0 = peak_list_data.mz;
+    const auto &assigned_formulas = peak_list_data.compound_strings;
+    char row[PrepareDataset::MAX_COMBO_ROW_LEN];
+    CompoundList all_possible_compounds_unsimplified;
+    ::std::vector<uint8_t> crit_bits;
+    ::std::vector<double> ppms;
+
+    // Masses of the assigned formulas for the unidentified report, one batch for the whole chunk
+    ::std::vector<double> assigned_masses(end - start);
+    Chem::get_compound_masses(::std::span<const Compound>(encoded_simplified.data() + start, end - start), assigned_masses.data());
+
+    if (shard != nullptr)
+      chunk.offset = shard->size();
+
+    for (size_t i = start; i < end; i++) {
+      const auto &encoded_unsimplified_assigned_formula = encoded_unsimplified[i];
+      const auto &encoded_simplified_assigned_formula = encoded_simplified[i];
+
+      auto ion = reagant_ion;
+	  
+      // change everything to work with views
+      if (reagant_ion == ReagantIon::NONE) {
+	ion = cm->find_reagant_ion(encoded_unsimplified_assigned_formula);
+	if (ion == ReagantIon::NONE) continue;
       }
+	
+      auto apc = all_possible_elemental_combo(x0[i], ion);
+      
+      all_possible_compounds_unsimplified.resize(apc.compounds.size());
+      Chem::simplify_and_factor(apc.compounds, nullptr, all_possible_compounds_unsimplified.data());
+      auto *all_possible_compounds_simplified = &apc.compounds;
+      auto *theoretical_masses = &apc.masses;
+      crit_bits.resize(all_possible_compounds_unsimplified.size());
+      Chem::get_criterea_bits_batch(all_possible_compounds_unsimplified, crit_bits.data());
+      ppms.resize(theoretical_masses->size());
+      Chem::get_ppms(x0[i], *theoretical_masses, ppms.data());
+
+      bool is_found{ false };
+      
+      for (size_t j{}; j < all_possible_compounds_simplified->size(); j++) {
+	const auto &permutation_simplified = (*all_possible_compounds_simplified)[j];
+	const auto &permutation_unsimplified = all_possible_compounds_unsimplified[j];
+	bool are_same = Chem::compounds_are_equal(permutation_simplified, encoded_simplified_assigned_formula);
+
+	if (are_same) {
+	  if (is_found) continue;
+	  is_found = true;
+	}
 
-      assigned_formulas.emplace_back(segment);
-      getline(ss, segment, '\t');
-      try {
-	x0.push_back(stof(segment));
-      } catch(...) {
-	throw ::std::runtime_error("Parse peak list error -- converting " + segment + " to double");
+	chunk.n_samples++;
+
+	if (shard == nullptr)
+	  chunk.rows.push_back(crit_bits[j], permutation_unsimplified, ppms[j], are_same);
+	else
+	  shard->append(row, format_combo_row(row, crit_bits[j], permutation_unsimplified, ppms[j], are_same));
       }
+
+      if (!is_found) {
+	double ppm = Chem::get_ppm(x0[i], assigned_masses[i - start]);
+	::std::ostringstream unidentified;
+	unidentified << assigned_formulas[i].val << "," << ppm << ::std::endl;
+	chunk.unidentified += unidentified.str();
+      }
+    }
+
+    if (shard != nullptr)
+      chunk.n_bytes = shard->size() - chunk.offset;
+  }
+
+  // ---- Rough relative cost of enumerating the candidates of each peak ----
+  static ::std::vector<double> estimate_combo_costs(::Chem::ReagantIon reagant_ion,
+						    const PeakListData &peak_list_data,
+						    const CompoundList &encoded_unsimplified) {
+    auto *cm = ChemMap::get_chem_map();
+    ::std::vector<double> costs(peak_list_data.mz.size(), 0.0);
+
+    for (size_t i{}; i < costs.size(); i++) {
+      auto ion = reagant_ion == ReagantIon::NONE ? cm->find_reagant_ion(encoded_unsimplified[i]) : reagant_ion;
+      if (ion == ReagantIon::NONE)
+	continue;
+
+      // The number of formulas in a ppm window grows with mz^(number of elements the ion allows)
+      auto n_elements = cm->get_reagant_ion_mask(ion).length;
+      costs[i] = 1.0 + ::std::pow(peak_list_data.mz[i] / 100.0, n_elements);
     }
 
-    return { ::std::move(x0), ::std::move(assigned_formulas) };
+    return costs;
+  }
+
+  // ---- Cut the peaks into chunks of about equal cost, returns the start of every chunk and the end ----
+  static ::std::vector<size_t> make_combo_chunks(const ::std::vector<double> &costs, size_t n_threads) {
+    double total_cost = ::std::accumulate(costs.begin(), costs.end(), 0.0);
+    double target_cost = total_cost / (n_threads * PrepareDataset::COMBO_CHUNKS_PER_THREAD);
+
+    ::std::vector<size_t> bounds = { 0 };
+    double chunk_cost{};
+    for (size_t i{}; i < costs.size(); i++) {
+      chunk_cost += costs[i];
+      if (chunk_cost >= target_cost || i + 1 - bounds.back() == PrepareDataset::COMBO_CHUNK_SIZE) {
+	bounds.push_back(i + 1);
+	chunk_cost = 0.0;
+      }
+    }
+
+    if (bounds.back() != costs.size())
+      bounds.push_back(costs.size());
+
+    return bounds;
   }
 
   // ---- Prepare and output training/inference ready data for all peaks in a peak list to a file ----
+  // ---- Rows are always written in peak order, so the output doesn't depend on n_threads        ----
   Bias PrepareDataset::create_combo_file(::std::string output_path,
 					 ::std::string unidentified_combos_path,
-					 ::Chem::unenc_compound reagant_ion,
+					 ::Chem::ReagantIon reagant_ion,
 					 const PeakListData &peak_list_data,
-					 const Matrix<double> &encoded_unsimplified,
-					 const Matrix<double> &encoded_simplified,
-					 int n_threads) {
+					 const CompoundList &encoded_unsimplified,
+					 const CompoundList &encoded_simplified,
+					 int n_threads,
+					 ::ComboFile::Format format,
+					 ::std::vector<WorkerStats> *worker_stats) {
     if (n_threads == 0)
       throw ::std::invalid_argument("Combo file creation error -- n_threads cannot be 0");
     
-    auto *x0 = &peak_list_data.mz;
-    auto *assigned_formulas = &peak_list_data.compound_strings;
-
-    size_t total_assigned = assigned_formulas->size();
-    size_t assigned_per_thread = (total_assigned + n_threads - 1) / n_threads;
+    size_t total_assigned = peak_list_data.compound_strings.size();
+    auto costs = estimate_combo_costs(reagant_ion, peak_list_data, encoded_unsimplified);
+    auto chunk_bounds = make_combo_chunks(costs, n_threads);
+    size_t n_chunks = chunk_bounds.size() - 1;
     
-    if (total_assigned < n_threads)
-      n_threads = static_cast<int>(total_assigned);
+    if (n_chunks < static_cast<size_t>(n_threads))
+      n_threads = static_cast<int>(n_chunks);
     
-    ::std::ofstream ostream(output_path);
+    bool binary = format == ::ComboFile::Format::BINARY;
+    ::std::ofstream ostream;
+
+    if (!binary)
+      ostream.open(output_path);
     
-    if (!ostream.is_open()) {
+    if (!binary && !ostream.is_open()) {
       throw ::std::runtime_error("Combo file creation error -- error opening output file");
     }
 
@@ -319,110 +789,118 @@ namespace Preprocess {
 
     not_found_ostream << "Compound,PPM" << ::std::endl;
 
-    ::std::vector< ::std::future<size_t> > workers;
-    workers.reserve(n_threads);
-    auto *tp = ThreadPool::get_thread_pool();
+    // Every thread appends its csv rows to its own shard file, so no output is shared while working
+    ::std::vector< ::std::unique_ptr<::FileUtils::BlockWriter> > shards;
+    if (!binary) {
+      for (int thread_num{}; thread_num < n_threads; thread_num++)
+	shards.push_back(::std::make_unique<::FileUtils::BlockWriter>(output_path + ".shard" + ::std::to_string(thread_num)));
+    }
 
-    ::std::mutex ostream_mtx;
+    auto remove_shards = [&shards] () {
+      for (auto &shard: shards) {
+	auto path = shard->get_path();
+	shard.reset();
+	::std::filesystem::remove(path);
+      }
+    };
 
-    auto *cm = ChemMap::get_chem_map();
+    // Heaviest chunks go first so no thread picks up a big one when the rest are almost done
+    ::std::vector<size_t> dispatch_order(n_chunks);
+    ::std::vector<double> chunk_costs(n_chunks);
+    for (size_t chunk_idx{}; chunk_idx < n_chunks; chunk_idx++)
+      chunk_costs[chunk_idx] = ::std::accumulate(costs.begin() + chunk_bounds[chunk_idx], costs.begin() + chunk_bounds[chunk_idx + 1], 0.0);
 
-    for (uint8_t thread_num{}; thread_num < n_threads; thread_num++) {
-      workers.push_back(tp->submit< size_t >([&, thread_num] (arena_t *arena) {
-	size_t start = thread_num * assigned_per_thread;
-	size_t end = ::std::min(start + assigned_per_thread, total_assigned);
+    ::std::iota(dispatch_order.begin(), dispatch_order.end(), 0);
+    ::std::stable_sort(dispatch_order.begin(), dispatch_order.end(), [&chunk_costs] (size_t a, size_t b) {
+      return chunk_costs[a] > chunk_costs[b];
+    });
 
-	::std::ostringstream data("");
-	::std::ostringstream unidentified("");
+    ::std::vector<ComboChunk> chunks(n_chunks);
+    ::std::vector< ::std::future<WorkerStats> > workers;
+    workers.reserve(n_threads);
+    auto *tp = ThreadPool::get_thread_pool();
 
-	size_t total_samples{};
-	for (size_t i = start; i < end; i++) {
-	  auto encoded_unsimplified_assigned_formula_view = encoded_unsimplified.get_row_view(i);
-	  auto encoded_simplified_assigned_formula_view = encoded_simplified.get_row_view(i);
+    ::std::atomic<size_t> next_chunk{ 0 };
+    for (int thread_num{}; thread_num < n_threads; thread_num++) {
+      workers.push_back(tp->submit< WorkerStats >([&, thread_num] (arena_t *arena) {
+	WorkerStats stats{};
+	auto *shard = binary ? nullptr : shards[thread_num].get();
+
+	for (size_t i = next_chunk++; i < n_chunks; i = next_chunk++) {
+	  size_t chunk_idx = dispatch_order[i];
+	  auto busy_start = ::std::chrono::steady_clock::now();
+
+	  chunks[chunk_idx].shard = thread_num;
+	  fill_combo_chunk(chunks[chunk_idx],
+			   chunk_bounds[chunk_idx],
+			   chunk_bounds[chunk_idx + 1],
+			   reagant_ion,
+			   peak_list_data,
+			   encoded_unsimplified,
+			   encoded_simplified,
+			   shard);
+
+	  stats.busy_seconds += ::std::chrono::duration<double>(::std::chrono::steady_clock::now() - busy_start).count();
+	  stats.n_chunks++;
+	  stats.n_peaks += chunk_bounds[chunk_idx + 1] - chunk_bounds[chunk_idx];
+	}
 
-	  ::Chem::unenc_compound ion = reagant_ion;
-	  
-	  // change everything to work with views
-	  if (reagant_ion.val.empty()) {
-	    ion = cm->find_reagant_ion(encoded_unsimplified_assigned_formula_view);
-	    if (ion.val.empty()) continue;
-	  }
-	
-	  auto apc = all_possible_elemental_combo(x0->at(i), ion);
-      
-	  auto all_possible_compounds_unsimplified = Chem::factor_polyatomics(apc.compounds);
-	  auto *all_possible_compounds_simplified = &apc.compounds;
-	  auto *theoretical_masses = &apc.masses;
+	if (shard != nullptr)
+	  shard->flush();
 
-	  bool is_found{ false };
-      
-	  for (size_t j{}; j < all_possible_compounds_simplified->get_rows(); j++) {
-	    auto permutation_simplified_view = all_possible_compounds_simplified->get_row_view(j);
-	    auto permutation_unsimplified_view = all_possible_compounds_unsimplified.get_row_view(j);
-	    bool are_same = Chem::compounds_are_equal(permutation_simplified_view, encoded_simplified_assigned_formula_view);
-
-	    if (are_same) {
-	      if (is_found) continue;
-	      is_found = true;
-	    }
-
-	    auto crit_check = Chem::check_criterea(permutation_unsimplified_view);
-	    auto *crit_mask = &crit_check.crit_mask;
-	    for (int k{}; k < N_CRITEREA; k++) {
-	      data << ::std::to_string((int) crit_mask->at(k)) + ",";
-	    }
-      
-	    for (int k{}; k < TOTAL_CHEMS; k++) {
-	      data << ::std::to_string(permutation_unsimplified_view[k]) + ",";
-	    }
-	    
-	    data << ::std::to_string(Chem::get_ppm(x0->at(i), theoretical_masses->at(j)))
-		 << "," + ::std::to_string(are_same) << ::std::endl;
-	    
-	    total_samples++;
-
-	    // output and reset buffer if data buffer size > 1kb
-	    if (data.tellp() > 1 << 10 || unidentified.tellp() > 1 << 10) {
-	      {
-		::std::lock_guard<::std::mutex> lg(ostream_mtx);
-		ostream << data.str();
-		not_found_ostream << unidentified.str();
-	      }
-	  
-	      data.str("");
-	      data.clear();
-	      unidentified.str("");
-	      unidentified.clear();
-	    }
-	  }
+	return stats;
+      }));
+    }
 
-	  if (!is_found) {
-	    double mass = Chem::get_compound_mass(encoded_simplified_assigned_formula_view);
-	    double ppm = Chem::get_ppm(x0->at(i), mass);
-	    unidentified << assigned_formulas->at(i).val << "," << ppm << ::std::endl;
-	  }
-	}
+    if (worker_stats != nullptr)
+      worker_stats->clear();
 
-	{
-	  ::std::lock_guard<::std::mutex> lg(ostream_mtx);
-	  ostream << data.str();
-	  not_found_ostream << unidentified.str();
-	}
-	
-	data.str("");
-	data.clear();
-	unidentified.str("");
-	unidentified.clear();
-      
-	return total_samples;
-      }));
+    // Wait for every worker before cleaning up, they all reference this stack frame
+    ::std::exception_ptr worker_error;
+    for (auto &f: workers) {
+      try {
+	auto stats = f.get();
+	if (worker_stats != nullptr)
+	  worker_stats->push_back(stats);
+      } catch (...) {
+	if (!worker_error)
+	  worker_error = ::std::current_exception();
+      }
     }
 
+    if (worker_error) {
+      remove_shards();
+      ::std::rethrow_exception(worker_error);
+    }
+
+    // Stitch the chunks together in peak order
+    ::std::vector<::FileUtils::MappedFile> shard_maps;
+    for (auto &shard: shards)
+      shard_maps.emplace_back(shard->get_path());
+
+    ::ComboFile::Rows rows;
     size_t total_samples{};
-    for (auto &f: workers) {
-      total_samples += f.get();
+    for (auto &chunk: chunks) {
+      if (binary) {
+	rows.append(chunk.rows);
+      } else {
+	auto shard_view = shard_maps[chunk.shard].view();
+	ostream.write(shard_view.data() + chunk.offset, chunk.n_bytes);
+      }
+
+      not_found_ostream << chunk.unidentified;
+      total_samples += chunk.n_samples;
+      chunk = ComboChunk();
     }
 
+    shard_maps.clear();
+    remove_shards();
+
+    if (binary)
+      ::ComboFile::write(output_path, reagant_ion, rows);
+    else if (!ostream.flush())
+      throw ::std::runtime_error("Combo file creation error -- writing " + output_path + " failed");
+
     return { total_assigned, total_samples - total_assigned };
   }
 
@@ -454,115 +932,93 @@ namespace Preprocess {
     }
   }
 
-  // ---- Seperate positive and negative samples ----
-  void data_sample_seperation(::std::string path,
-			      ::std::vector< ::std::vector<double> > &data_ones,
-			      ::std::vector< ::std::vector<double> > &data_zeros) {
-    ::std::ifstream is(path);
+  // ---- Draw k distinct indeces from [0, n) with Floyd's algorithm, returned sorted ----
+  static ::std::vector<size_t> sample_indeces(size_t n, size_t k) {
+    auto &rng = ::CNum::Utils::Rand::RandomGenerator::instance();
+    ::std::unordered_set<size_t> chosen;
+    chosen.reserve(k);
 
-    if (!is.is_open()) {
-      throw ::std::runtime_error("Sample seperation error -- opening input file failed");
+    for (size_t j = n - k; j < n; j++) {
+      ::std::uniform_int_distribution<size_t> dist(0, j);
+      size_t idx = dist(rng);
+      chosen.insert(chosen.count(idx) ? j : idx);
     }
 
-    ::std::string line;
-    while (getline(is, line, '\n')) {
-      ::std::vector<double> sample;
-      ::std::istringstream iss(line);
-      ::std::string segment;
-
-      while (getline(iss, segment, ',')) {
-	try {
-	  sample.push_back(stod(segment));
-	} catch (...) {
-	  throw ::std::runtime_error("Train test split error -- error converting " + segment + " to double");
-	}
-      }
+    ::std::vector<size_t> sorted_idx(chosen.begin(), chosen.end());
+    ::std::sort(sorted_idx.begin(), sorted_idx.end());
+    return sorted_idx;
+  }
 
-      if (sample.back() == 1.0) {
-	data_ones.push_back(sample);
-      } else {
-	data_zeros.push_back(sample);
-      }
-    }
+  // ---- Label of a combo file row (the last column) ----
+  static size_t get_combo_class(::std::string_view line) {
+    auto label = line.substr(line.rfind(',') + 1);
+    double value;
+    if (!::FileUtils::parse_double(label, value))
+      throw ::std::runtime_error("Train test split error -- error converting " + ::std::string(label) + " to double");
+
+    return value == 1.0 ? 0 : 1; // positives are class 0, negatives class 1
   }
 
   // ---- Seperate train and test datasets ----
+  // ---- Streams the combo file twice (count, then route rows) so only the test indeces are held in memory ----
   void PrepareDataset::train_test_split(::std::string combo_file_path,
 					::std::string output_path,
 					size_t n_test_pos,
 					size_t n_test_neg) {
-    ::std::vector< ::std::vector<double> > data_ones;
-    ::std::vector< ::std::vector<double> > data_zeros;
-    data_sample_seperation(combo_file_path, ::std::ref(data_ones), ::std::ref(data_zeros));
-    assert(!data_ones.empty());
-    assert(!data_zeros.empty());
+    ::FileUtils::MappedFile file(combo_file_path);
+
+    ::std::array<size_t, 2> class_sizes{};
+    auto text = file.view();
+    while (!text.empty()) {
+      auto line = ::FileUtils::next_line(text);
+      if (!line.empty())
+	class_sizes[get_combo_class(line)]++;
+    }
 
-    auto &rng = ::CNum::Utils::Rand::RandomGenerator::instance();
-    
-    ::std::array< ::std::vector< ::std::vector<double> >, 2 > data = {
-      ::std::move(data_ones),
-      ::std::move(data_zeros)
-    };
-    
-    ::std::array< ::std::unordered_map<int, int>, 2 > used_idx{};
     ::std::array<size_t, 2> test_set_sizes = { n_test_pos, n_test_neg };
+    ::std::array< ::std::vector<size_t>, 2 > test_idx;
+    for (int x = 0; x < 2; x++) {
+      if (test_set_sizes[x] > class_sizes[x])
+	throw ::std::invalid_argument("Train test split error -- asked for " + ::std::to_string(test_set_sizes[x]) + " test samples of a class with "
+				      + ::std::to_string(class_sizes[x]));
+
+      test_idx[x] = sample_indeces(class_sizes[x], test_set_sizes[x]);
+    }
     
     std::string test_path = output_path + "_test_combos.csv";
     std::string train_path = output_path + "_train_combos.csv";
-    ::std::ofstream os(test_path);
+    ::std::ofstream test_os(test_path);
 
-    if (!os.is_open()) {
+    if (!test_os.is_open()) {
       throw ::std::runtime_error("Train test split error -- problem opening test output file");
     }
 
-    for (int x = 0; x < 2; x++) {
-      ::std::uniform_int_distribution<int> dist(0, data[x].size() - 1);
+    ::std::ofstream train_os(train_path);
 
-      size_t i{};
-      while (i < test_set_sizes[x]) {
-	size_t idx = dist(rng);
-
-	if (used_idx[x][idx] > 0) {
-	  continue;
-	}
-	
-	used_idx[x][idx]++;
-    
-	::std::string output{""};
-	for (int j = 0; j < data[x][0].size(); j++) {
-	  output += ::std::to_string(data[x][idx][j]) + ",";
-	}
-    
-	output.pop_back();
-
-	os << output << ::std::endl;
-	i++;
-      }
-    }
-    
-    os.close();
-    os = ::std::ofstream(train_path);
-
-    if (!os.is_open()) {
+    if (!train_os.is_open()) {
       throw ::std::runtime_error("Train test split error -- problem opening train output file");
     }
 
-    for (int x = 0; x < 2; x++) {
-      for (size_t i{}; i < data[x].size(); i++) {
-	if (used_idx[x][i] > 0) {
-	  continue;
-	}
+    // Rows keep their file order, a row goes to test if its index within its class was sampled
+    ::std::array<size_t, 2> class_pos{};
+    ::std::array<size_t, 2> next_test{};
+    text = file.view();
+    while (!text.empty()) {
+      auto line = ::FileUtils::next_line(text);
+      if (line.empty())
+	continue;
 
-	::std::string output{""};
-	for (size_t j = 0; j < data[x][0].size(); j++) {
-	  output += ::std::to_string(data[x][i][j]) + ",";
-	}
-    
-	output.pop_back();
+      size_t x = get_combo_class(line);
+      bool is_test = next_test[x] < test_idx[x].size() && test_idx[x][next_test[x]] == class_pos[x];
+      if (is_test)
+	next_test[x]++;
 
-	os << output << ::std::endl;
-      }
+      class_pos[x]++;
+      (is_test ? test_os : train_os) << line << '\n';
     }
+
+    if (!test_os.flush() || !train_os.flush())
+      throw ::std::runtime_error("Train test split error -- problem writing output files");
   }
 
   // ---- Get the number of positive and number of negative samples ----
@@ -581,93 +1037,184 @@ namespace Preprocess {
     return { ones, zeros };
   }
 
+  // ---- Shuffle the indeces of n_peaks peaks and split them into { train, test } ----
+  ::std::array< ::std::vector<size_t>, 2 > PrepareDataset::shuffle_split(size_t n_peaks, double test_percentage) {
+    ::std::vector<size_t> order(n_peaks);
+    ::std::iota(order.begin(), order.end(), 0);
+
+    // Shuffling indeces draws from the rng exactly like shuffling the lines themselves did
+    auto &rng = ::CNum::Utils::Rand::RandomGenerator::instance();
+    ::std::shuffle(order.begin(), order.end(), rng);
+
+    /* Train takes every i < n_peaks * (1 - test_percentage) while test starts at that value truncated,
+       so when it isn't a whole number one peak is in both. Kept so existing splits are reproduced */
+    size_t train_end{};
+    while (train_end < n_peaks && train_end < n_peaks * (1 - test_percentage))
+      train_end++;
+
+    size_t test_start = ::std::min(static_cast<size_t>(n_peaks * (1 - test_percentage)), n_peaks);
+
+    return {
+      ::std::vector<size_t>(order.begin(), order.begin() + train_end),
+      ::std::vector<size_t>(order.begin() + test_start, order.end())
+    };
+  }
+
+  // ---- Split a peak list file into train and test peak list files ----
   void PrepareDataset::peak_list_train_test_split(::std::string peak_list_path,
 						  ::std::string output_path,
 						  double test_percentage) {
-    ::std::ifstream istream(peak_list_path);
-    if (!istream.is_open()) {
-      throw ::std::runtime_error("Peak list train/test split error -- Could not open peak list");
-    }
+    ::FileUtils::MappedFile file(peak_list_path);
+    auto text = file.view();
+    ::FileUtils::next_line(text); // headers
 
-    ::std::ofstream train_out(output_path + "_train.txt");
-    if (!train_out.is_open()) {
-      throw ::std::runtime_error("Peak list train/test split error -- Could not open train output list");
-    }
+    IonPeakList peak_list;
+    while (!text.empty())
+      peak_list.lines.emplace_back(::FileUtils::next_line(text));
+
+    auto split = shuffle_split(peak_list.lines.size(), test_percentage);
+    write_peak_list(output_path + "_train.txt", peak_list, split[0], false);
+    write_peak_list(output_path + "_test.txt", peak_list, split[1], false);
+  }
+
+  // ---- Parse a peak list once and sort its peaks by reagent ion, every ion gets an entry ----
+  // ---- and peaks keep their file order within it                                         ----
+  ::std::map< ::Chem::ReagantIon, IonPeakList > PrepareDataset::parse_peak_list_by_reagant_ion(::std::string peak_list_path,
+												     bool keep_lines) {
+    using IonPeakLists = ::std::map< ::Chem::ReagantIon, IonPeakList >;
+    auto *cm = ChemMap::get_chem_map();
+    const auto &reagant_ions = cm->get_reagant_ions();
+
+    ::FileUtils::MappedFile file(peak_list_path);
+    auto text = file.view();
+    auto headers = ::FileUtils::next_line(text);
+
+    constexpr uint8_t ion_col = 2, x0_col = 3;
+    auto chunks = ::FileUtils::split_into_chunks(text, ::std::max(::std::thread::hardware_concurrency(), 1u));
 
-    ::std::ofstream test_out(output_path + "_test.txt");
-    if (!test_out.is_open()) {
-      throw ::std::runtime_error("Peak list train/test split error -- Could not open test output list");
+    ::std::vector< ::std::future<IonPeakLists> > workers;
+    workers.reserve(chunks.size());
+    auto *tp = ThreadPool::get_thread_pool();
+
+    for (auto chunk: chunks) {
+      workers.push_back(tp->submit< IonPeakLists >([chunk, cm, keep_lines] (arena_t *arena) mutable {
+	IonPeakLists res;
+	while (!chunk.empty()) {
+	  auto line = ::FileUtils::next_line(chunk);
+	  auto formula = ::FileUtils::get_field(line, ion_col);
+	  auto encoded = encode_compound(formula);
+
+	  auto simplified = encoded;
+	  Chem::simplify_compound(simplified);
+	  auto ion = cm->find_reagant_ion(simplified);
+	  if (ion == ReagantIon::NONE)
+	    continue;
+
+	  auto x0_field = ::FileUtils::get_field(line, x0_col);
+	  double x0;
+	  if (!::FileUtils::parse_double(x0_field, x0))
+	    throw ::std::runtime_error("Parse peak list error -- converting " + ::std::string(x0_field) + " to double");
+
+	  auto &peak_list = res[ion];
+	  peak_list.peaks.mz.push_back(x0);
+	  peak_list.peaks.compound_strings.push_back({ ::std::string(formula) });
+	  peak_list.encoded_unsimplified.push_back(encoded);
+	  if (keep_lines)
+	    peak_list.lines.emplace_back(line);
+	}
+
+	return res;
+      }));
     }
-    
-    ::std::vector<::std::string> lines;
-    ::std::string line, headers;
-    getline(istream, headers, '\n');
-    
-    
-    while (getline(istream, line, '\n')) {
-      lines.push_back(line);
+
+    IonPeakLists res;
+    for (auto ion: reagant_ions) {
+      if (keep_lines)
+	res[ion].headers = headers;
     }
 
-    auto &rng = ::CNum::Utils::Rand::RandomGenerator::instance();
-    ::std::shuffle(lines.begin(), lines.end(), rng);
-    
-    for (size_t i{}; i < lines.size() * (1 - test_percentage); i++) {
-      train_out << lines[i] << ::std::endl;
+    // get() on every worker before rethrowing, they all read from the mapped file
+    ::std::vector<IonPeakLists> chunk_results;
+    chunk_results.reserve(workers.size());
+    ::std::exception_ptr error;
+    for (auto &worker: workers) {
+      try {
+	chunk_results.push_back(worker.get());
+      } catch (...) {
+	if (!error)
+	  error = ::std::current_exception();
+      }
     }
 
-    for (size_t i = lines.size() * (1 - test_percentage); i < lines.size(); i++) {
-      test_out << lines[i] << ::std::endl;
+    if (error)
+      ::std::rethrow_exception(error);
+
+    for (auto &chunk_peak_lists: chunk_results) {
+      for (auto &[ion, chunk_peak_list]: chunk_peak_lists) {
+	auto &peak_list = res[ion];
+	auto &peaks = chunk_peak_list.peaks;
+	peak_list.peaks.mz.insert(peak_list.peaks.mz.end(), peaks.mz.begin(), peaks.mz.end());
+	peak_list.peaks.compound_strings.insert(peak_list.peaks.compound_strings.end(),
+						::std::make_move_iterator(peaks.compound_strings.begin()),
+						::std::make_move_iterator(peaks.compound_strings.end()));
+	peak_list.encoded_unsimplified.insert(peak_list.encoded_unsimplified.end(),
+					      chunk_peak_list.encoded_unsimplified.begin(),
+					      chunk_peak_list.encoded_unsimplified.end());
+	peak_list.lines.insert(peak_list.lines.end(),
+			       ::std::make_move_iterator(chunk_peak_list.lines.begin()),
+			       ::std::make_move_iterator(chunk_peak_list.lines.end()));
+      }
     }
 
-    istream.close();
-    train_out.close();
-    test_out.close();
+    return res;
   }
 
-  // switch masks to spans, create individual decode and encode funcs
-  
-  void PrepareDataset::split_by_reagant_ion(::std::string peak_list_path, ::std::string output_path) {
-    auto *cm = ChemMap::get_chem_map();
-    const auto &reagant_ions = cm->get_reagant_ions();
-    ::std::unordered_map<::std::string, ::std::ofstream> outputs;
+  // ---- Take the peaks at idx (in that order), raw lines are left behind ----
+  IonPeakList PrepareDataset::gather_peaks(const IonPeakList &peak_list, const ::std::vector<size_t> &idx) {
+    IonPeakList res;
+    res.peaks.mz.reserve(idx.size());
+    res.peaks.compound_strings.reserve(idx.size());
+    res.encoded_unsimplified.reserve(idx.size());
+
+    for (auto i: idx) {
+      res.peaks.mz.push_back(peak_list.peaks.mz[i]);
+      res.peaks.compound_strings.push_back(peak_list.peaks.compound_strings[i]);
+      if (!peak_list.encoded_unsimplified.empty())
+	res.encoded_unsimplified.push_back(peak_list.encoded_unsimplified[i]);
+    }
 
-    for (auto &ion: reagant_ions) {
-      auto path = output_path + ion.val + ".txt";
-      outputs[ion.val] = ::std::ofstream(path);
+    return res;
+  }
 
-      if (!outputs[ion.val].is_open()) {
-	throw ::std::runtime_error("Split by reagant ion error -- couldn't open " + ion.val + " output file");
-      }
-    }
+  // ---- Write the raw lines at idx of a peak list to a file ----
+  void PrepareDataset::write_peak_list(::std::string path,
+				       const IonPeakList &peak_list,
+				       const ::std::vector<size_t> &idx,
+				       bool write_headers) {
+    ::std::ofstream os(path);
+    if (!os.is_open())
+      throw ::std::runtime_error("Write peak list error -- couldn't open " + path);
 
-    ::std::ifstream is(peak_list_path);
-    if (!is.is_open()) {
-      throw ::std::runtime_error("Split by reagant ion error -- couldn't open input file");
-    }
+    if (write_headers)
+      os << peak_list.headers << '\n';
 
-    constexpr uint8_t ion_col = 3;
-    
-    ::std::string line;
-    getline(is, line, '\n');
-    for (auto &ion: reagant_ions)
-      outputs[ion.val] << line << ::std::endl;
-    
-    while (getline(is, line, '\n')) {
-      ::std::istringstream iss(line);
-      unenc_compound c{ "" };
-      for (int i{}; i < ion_col; i++) {
-	getline(iss, c.val, ',');
-      }
+    for (auto i: idx)
+      os << peak_list.lines[i] << '\n';
 
-      ::std::vector< unenc_compound > dc = { c };
-      auto ec = ::Preprocess::simplify_compounds(::Preprocess::encode_compounds(dc));
-      auto ec_view = ec.get_row_view(0);
+    if (!os.flush())
+      throw ::std::runtime_error("Write peak list error -- couldn't write " + path);
+  }
 
-      auto ion = cm->find_reagant_ion(ec_view);
-      if (ion.val.empty())
-	continue;
+  // switch masks to spans, create individual decode and encode funcs
+  
+  void PrepareDataset::split_by_reagant_ion(::std::string peak_list_path, ::std::string output_path) {
+    auto *cm = ChemMap::get_chem_map();
+    auto peak_lists = parse_peak_list_by_reagant_ion(peak_list_path, true);
 
-      outputs[ion.val] << line << ::std::endl;
+    for (auto &[ion, peak_list]: peak_lists) {
+      ::std::vector<size_t> idx(peak_list.lines.size());
+      ::std::iota(idx.begin(), idx.end(), 0);
+      write_peak_list(output_path + cm->get_reagant_ion_name(ion) + ".txt", peak_list, idx, true);
     }
   }
 
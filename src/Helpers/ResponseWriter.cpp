@@ -0,0 +1,170 @@
+#include "ResponseWriter.h"
+
+namespace ResponseWriter {
+  size_t Response::size() const {
+    return scores.size();
+  }
+
+  // ------------------
+  // Format
+  // ------------------
+
+  // ---- The binary layout is only used when the client lists it in its Accept header ----
+  Format negotiate_format(::std::string_view accept) {
+    return accept.find(BINARY_CONTENT_TYPE) != ::std::string_view::npos ? Format::BINARY : Format::JSON;
+  }
+
+  ::std::string_view get_content_type(Format format) {
+    return format == Format::BINARY ? BINARY_CONTENT_TYPE : JSON_CONTENT_TYPE;
+  }
+
+  // ------------------
+  // JSON
+  // ------------------
+
+  static void put_number(::std::string &out, double value) {
+    // JSON has no NaN or infinity
+    if (!::std::isfinite(value)) {
+      out += "null";
+      return;
+    }
+
+    char buf[MAX_NUMBER_LEN];
+    auto end = ::std::to_chars(buf, buf + sizeof(buf), value).ptr;
+    out.append(buf, end);
+  }
+
+  static void put_number(::std::string &out, size_t value) {
+    char buf[MAX_NUMBER_LEN];
+    auto end = ::std::to_chars(buf, buf + sizeof(buf), value).ptr;
+    out.append(buf, end);
+  }
+
+  static void put_string(::std::string &out, ::std::string_view s) {
+    out.push_back('"');
+    for (char c: s) {
+      // Formulas and cursors never need escaping, this only keeps the output valid if that changes
+      if (c == '"' || c == '\\')
+	out.push_back('\\');
+      out.push_back(c);
+    }
+    out.push_back('"');
+  }
+
+  template <typename F>
+  static void put_array(::std::string &out, const char *name, size_t n, F put_element) {
+    out.push_back('"');
+    out += name;
+    out += "\":[";
+    for (size_t i{}; i < n; i++) {
+      if (i != 0)
+	out.push_back(',');
+      put_element(i);
+    }
+    out += "],";
+  }
+
+  // ---- Write the response as JSON with the same fields as /predict ----
+  void write_json(const Response &response, ::std::string &out) {
+    size_t n_rows = response.size();
+    constexpr size_t typical_row_len = 3 * MAX_NUMBER_LEN + 2 * 24 + 10;
+    out.clear();
+    out.reserve(n_rows * typical_row_len + 128);
+
+    out.push_back('{');
+    put_array(out, "scores", n_rows, [&] (size_t i) { put_number(out, response.scores[i]); });
+    put_array(out, "compounds", n_rows, [&] (size_t i) { put_string(out, response.compounds[i]); });
+    put_array(out, "uCompounds", n_rows, [&] (size_t i) { put_string(out, response.u_compounds[i]); });
+    put_array(out, "ppms", n_rows, [&] (size_t i) { put_number(out, response.ppms[i]); });
+    put_array(out, "critereaEncodings", n_rows, [&] (size_t i) {
+      out.push_back('[');
+      for (size_t k{}; k < ::Chem::N_CRITEREA; k++) {
+	if (k != 0)
+	  out.push_back(',');
+	out.push_back((response.crit_bits[i] >> k) & 1 ? '1' : '0');
+      }
+      out.push_back(']');
+    });
+
+    out += "\"totalCandidates\":";
+    put_number(out, response.total_candidates);
+    if (!response.next_cursor.empty()) {
+      out += ",\"nextCursor\":";
+      put_string(out, response.next_cursor);
+    }
+    out.push_back('}');
+  }
+
+  // ------------------
+  // Binary
+  // ------------------
+
+  static void put_bytes(::std::string &out, const void *bytes, size_t n_bytes) {
+    out.append(reinterpret_cast<const char *>(bytes), n_bytes);
+  }
+
+  static void put_column_length(::std::string &out, size_t n_bytes) {
+    uint32_t length = static_cast<uint32_t>(n_bytes);
+    put_bytes(out, &length, sizeof(length));
+  }
+
+  static void put_float_column(::std::string &out, const ::std::vector<double> &values) {
+    put_column_length(out, values.size() * sizeof(float));
+    for (double value: values) {
+      float f = static_cast<float>(value);
+      put_bytes(out, &f, sizeof(f));
+    }
+  }
+
+  static void put_string_table(::std::string &out, const ::Preprocess::FormulaArena &strings) {
+    size_t n_chars{};
+    for (size_t i{}; i < strings.size(); i++)
+      n_chars += strings[i].size();
+
+    put_column_length(out, (strings.size() + 1) * sizeof(uint32_t) + n_chars);
+    uint32_t offset{};
+    put_bytes(out, &offset, sizeof(offset));
+    for (size_t i{}; i < strings.size(); i++) {
+      offset += static_cast<uint32_t>(strings[i].size());
+      put_bytes(out, &offset, sizeof(offset));
+    }
+
+    for (size_t i{}; i < strings.size(); i++)
+      out += strings[i];
+  }
+
+  // ---- Write the response as length prefixed columns ----
+  void write_binary(const Response &response, ::std::string &out) {
+    size_t n_rows = response.size();
+    if (n_rows > ::std::numeric_limits<uint32_t>::max())
+      throw ::std::runtime_error("Response writer error -- too many rows for a binary response");
+
+    constexpr size_t typical_formula_len = 16;
+    out.clear();
+    out.reserve(sizeof(Header) + 6 * sizeof(uint32_t) + n_rows * (2 * sizeof(float) + 1 + 2 * (sizeof(uint32_t) + typical_formula_len))
+		+ response.next_cursor.size());
+
+    Header header{};
+    ::std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.n_rows = static_cast<uint32_t>(n_rows);
+    header.total_candidates = response.total_candidates;
+    put_bytes(out, &header, sizeof(Header));
+
+    put_float_column(out, response.scores);
+    put_float_column(out, response.ppms);
+    put_column_length(out, n_rows);
+    put_bytes(out, response.crit_bits.data(), n_rows);
+    put_string_table(out, response.compounds);
+    put_string_table(out, response.u_compounds);
+    put_column_length(out, response.next_cursor.size());
+    out += response.next_cursor;
+  }
+
+  void write(Format format, const Response &response, ::std::string &out) {
+    if (format == Format::BINARY)
+      write_binary(response, out);
+    else
+      write_json(response, out);
+  }
+}
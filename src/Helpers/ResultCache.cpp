@@ -0,0 +1,91 @@
+#include "ResultCache.h"
+
+namespace ResultCache {
+  // ---- Combine the key fields into one hash ----
+  size_t KeyHash::operator()(const Key &key) const {
+    size_t h = ::std::hash<uint8_t>{}(static_cast<uint8_t>(key.reagant_ion));
+    h ^= ::std::hash<int64_t>{}(key.mz_bucket) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+  }
+
+  // ---- Constructor ----
+  ShardedLRU::ShardedLRU(size_t max_candidates, size_t n_shards, double mz_resolution)
+    : _shard_capacity(max_candidates / ::std::max<size_t>(n_shards, 1)),
+      _mz_resolution(mz_resolution) {
+    if (n_shards == 0)
+      throw ::std::invalid_argument("Result cache error -- n_shards cannot be 0");
+
+    if (mz_resolution <= 0.0)
+      throw ::std::invalid_argument("Result cache error -- mz_resolution must be positive");
+
+    _shards.reserve(n_shards);
+    for (size_t i{}; i < n_shards; i++)
+      _shards.push_back(::std::make_unique<Shard>());
+  }
+
+  ShardedLRU::Shard &ShardedLRU::get_shard(const Key &key) {
+    return *_shards[KeyHash{}(key) % _shards.size()];
+  }
+
+  // ---- m/z values within the same resolution bucket share an entry ----
+  Key ShardedLRU::make_key(::Chem::ReagantIon reagant_ion, double mz) const {
+    return { reagant_ion, ::std::llround(mz / _mz_resolution) };
+  }
+
+  // ---- Look up an entry and mark it as most recently used, nullptr on a miss ----
+  ::std::shared_ptr<const Entry> ShardedLRU::get(const Key &key) {
+    auto &shard = get_shard(key);
+    ::std::lock_guard<::std::mutex> lg(shard.mtx);
+
+    auto it = shard.lookup.find(key);
+    if (it == shard.lookup.end()) {
+      _misses.fetch_add(1, ::std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    _hits.fetch_add(1, ::std::memory_order_relaxed);
+    return it->second->second;
+  }
+
+  // ---- Insert an entry and evict the least recently used ones until the shard fits ----
+  void ShardedLRU::put(const Key &key, ::std::shared_ptr<const Entry> entry) {
+    size_t n_candidates = entry->encoded_compounds.size();
+    if (n_candidates > _shard_capacity)
+      return;
+
+    auto &shard = get_shard(key);
+    ::std::lock_guard<::std::mutex> lg(shard.mtx);
+
+    auto it = shard.lookup.find(key);
+    if (it != shard.lookup.end()) {
+      shard.candidates -= it->second->second->encoded_compounds.size();
+      shard.lru.erase(it->second);
+      shard.lookup.erase(it);
+    }
+
+    while (!shard.lru.empty() && shard.candidates + n_candidates > _shard_capacity) {
+      auto &oldest = shard.lru.back();
+      shard.candidates -= oldest.second->encoded_compounds.size();
+      shard.lookup.erase(oldest.first);
+      shard.lru.pop_back();
+      _evictions.fetch_add(1, ::std::memory_order_relaxed);
+    }
+
+    shard.lru.emplace_front(key, ::std::move(entry));
+    shard.lookup[key] = shard.lru.begin();
+    shard.candidates += n_candidates;
+  }
+
+  // ---- Counters and current size ----
+  Stats ShardedLRU::get_stats() {
+    Stats stats{ _hits.load(), _misses.load(), _evictions.load(), 0, 0 };
+    for (auto &shard: _shards) {
+      ::std::lock_guard<::std::mutex> lg(shard->mtx);
+      stats.entries += shard->lookup.size();
+      stats.candidates += shard->candidates;
+    }
+
+    return stats;
+  }
+}
@@ -1,7 +1,11 @@
 #include "SysUtils.h"
+#include "InferenceAPI.h"
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,18 +19,95 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-  static void execute_command(char **argv) {
+  // ---- Run a command to completion, returns its exit status or -1 if it didn't exit normally ----
+  static int execute_command(char **argv, const int *inherit_fds, size_t n_inherit_fds) {
     pid_t pid = fork();
     if (pid == 0) {
+      for (size_t i = 0; i < n_inherit_fds; i++)
+	fcntl(inherit_fds[i], F_SETFD, 0);
+
       execvp(argv[0], argv);
       perror(argv[0]);
       _exit(127);
     } else if (pid > 0) {
       int status;
-      waitpid(pid, &status, 0);
+      while (waitpid(pid, &status, 0) < 0) {
+	if (errno != EINTR)
+	  return -1;
+      }
+
+      return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
     } else {
       fprintf(stderr, "Error executing command: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  // ---- Wait until fd is ready for events, returns false once the deadline passes ----
+  static bool wait_for_fd(int fd, short events, long long deadline_ms) {
+    struct pollfd pfd = { fd, events, 0 };
+    for (;;) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long long remaining = deadline_ms - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+      if (remaining <= 0)
+	return false;
+
+      int ready = poll(&pfd, 1, remaining > 1000000 ? 1000000 : (int) remaining);
+      if (ready > 0)
+	return true;
+
+      if (ready < 0 && errno != EINTR)
+	return false;
+    }
+  }
+
+  static long long deadline_after(long long timeout_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000 + timeout_ms;
+  }
+
+  // ---- Write or read exactly n bytes before the deadline ----
+  static bool write_full(int fd, const char *buf, size_t n, long long deadline_ms) {
+    while (n > 0) {
+      if (!wait_for_fd(fd, POLLOUT, deadline_ms))
+	return false;
+
+      ssize_t written = write(fd, buf, n);
+      if (written < 0) {
+	if (errno == EINTR || errno == EAGAIN)
+	  continue;
+	return false;
+      }
+
+      buf += written;
+      n -= written;
+    }
+
+    return true;
+  }
+
+  static bool read_full(int fd, char *buf, size_t n, long long deadline_ms) {
+    while (n > 0) {
+      if (!wait_for_fd(fd, POLLIN, deadline_ms))
+	return false;
+
+      ssize_t got = read(fd, buf, n);
+      if (got < 0) {
+	if (errno == EINTR || errno == EAGAIN)
+	  continue;
+	return false;
+      }
+
+      if (got == 0)
+	return false; // the worker closed its stdout, it exited or crashed
+
+      buf += got;
+      n -= got;
     }
+
+    return true;
   }
 #ifdef __cplusplus
 }
@@ -38,7 +119,8 @@ extern "C" {
 
 void execute_peak_fit_bin(::std::string mz_b,
 			  ::std::string mz_av,
-			  ::std::string output_path) {
+			  ::std::string output_path,
+			  const ::std::vector<int> &inherit_fds) {
 
   char **argv = (char **) malloc(sizeof(char *) * 5); // 4 args + a null terminator
   char c_mz_b[mz_b.size() + 1];
@@ -55,6 +137,177 @@ void execute_peak_fit_bin(::std::string mz_b,
   argv[3] = &c_output_path[0];
   argv[4] = NULL;
   
-  execute_command(argv);
+  int status = execute_command(argv, inherit_fds.data(), inherit_fds.size());
   free(argv);
+
+  if (status != 0)
+    throw ::std::runtime_error("Peak fit error -- " + ::std::string(::InferenceAPI::python_executable_path) + " failed with status " + ::std::to_string(status));
+}
+
+// ----------------
+// Worker Pool
+// ----------------
+
+// ---- Start n_workers workers, each runs executable with args ----
+PeakFitWorkerPool::PeakFitWorkerPool(const ::std::string &executable,
+				     const ::std::vector<::std::string> &args,
+				     size_t n_workers,
+				     ::std::chrono::milliseconds timeout)
+  : _timeout(timeout),
+    _workers(n_workers) {
+  if (n_workers == 0)
+    throw ::std::invalid_argument("Peak fit error -- the worker pool needs at least one worker");
+
+  // A worker dying mid request must fail the write, not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  _args.push_back(executable);
+  _args.insert(_args.end(), args.begin(), args.end());
+  for (auto &arg: _args)
+    _argv.push_back(arg.data());
+  _argv.push_back(NULL);
+
+  for (size_t i{}; i < n_workers; i++) {
+    spawn(_workers[i]);
+    _idle.push_back(i);
+  }
+}
+
+PeakFitWorkerPool::~PeakFitWorkerPool() {
+  for (auto &worker: _workers)
+    kill(worker);
+}
+
+void PeakFitWorkerPool::spawn(Worker &worker) {
+  int to_worker[2], from_worker[2];
+  if (pipe2(to_worker, O_CLOEXEC) != 0)
+    throw ::std::runtime_error("Peak fit error -- couldn't create worker pipes: " + ::std::string(strerror(errno)));
+
+  if (pipe2(from_worker, O_CLOEXEC) != 0) {
+    close(to_worker[0]);
+    close(to_worker[1]);
+    throw ::std::runtime_error("Peak fit error -- couldn't create worker pipes: " + ::std::string(strerror(errno)));
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // dup2 clears close on exec for the worker's own stdin and stdout
+    dup2(to_worker[0], STDIN_FILENO);
+    dup2(from_worker[1], STDOUT_FILENO);
+    execvp(_argv[0], _argv.data());
+    perror(_argv[0]);
+    _exit(127);
+  }
+
+  close(to_worker[0]);
+  close(from_worker[1]);
+  if (pid < 0) {
+    close(to_worker[1]);
+    close(from_worker[0]);
+    throw ::std::runtime_error("Peak fit error -- couldn't start a worker: " + ::std::string(strerror(errno)));
+  }
+
+  worker = { pid, to_worker[1], from_worker[0] };
+}
+
+void PeakFitWorkerPool::kill(Worker &worker) {
+  if (worker.to_worker >= 0)
+    close(worker.to_worker);
+  if (worker.from_worker >= 0)
+    close(worker.from_worker);
+
+  if (worker.pid > 0) {
+    ::kill(worker.pid, SIGKILL);
+    while (waitpid(worker.pid, NULL, 0) < 0 && errno == EINTR);
+  }
+
+  worker = Worker{};
+}
+
+// ---- Take an idle worker, a worker that exited since its last request is restarted first ----
+size_t PeakFitWorkerPool::acquire() {
+  size_t idx;
+  {
+    ::std::unique_lock<::std::mutex> lock(_mtx);
+    _cv.wait(lock, [this] { return !_idle.empty(); });
+    idx = _idle.back();
+    _idle.pop_back();
+  }
+
+  auto &worker = _workers[idx];
+  if (worker.pid <= 0 || waitpid(worker.pid, NULL, WNOHANG) != 0) {
+    worker.pid = -1; // already reaped, or never started
+    kill(worker);
+    try {
+      spawn(worker);
+    } catch (...) {
+      release(idx);
+      throw;
+    }
+  }
+
+  return idx;
+}
+
+void PeakFitWorkerPool::release(size_t idx) {
+  {
+    ::std::lock_guard<::std::mutex> lg(_mtx);
+    _idle.push_back(idx);
+  }
+
+  _cv.notify_one();
+}
+
+// ---- Send a spectrum to a worker and wait for its peaks, a worker that times out or breaks the protocol is replaced ----
+::std::vector<double> PeakFitWorkerPool::fit(::std::string_view mz_base, ::std::string_view mz_av) {
+  size_t idx = acquire();
+  auto &worker = _workers[idx];
+  long long deadline = deadline_after(_timeout.count());
+
+  auto fail = [&] (const ::std::string &msg) {
+    kill(worker);
+    try {
+      spawn(worker);
+    } catch (const ::std::exception &e) {
+      ::std::cerr << e.what() << ::std::endl; // retried by the next acquire
+    }
+
+    release(idx);
+    throw ::std::runtime_error("Peak fit error -- " + msg);
+  };
+
+  for (auto csv: { mz_base, mz_av }) {
+    uint32_t len = static_cast<uint32_t>(csv.size());
+    if (!write_full(worker.to_worker, reinterpret_cast<const char *>(&len), sizeof(len), deadline)
+	|| !write_full(worker.to_worker, csv.data(), csv.size(), deadline))
+      fail("couldn't send the spectrum to worker " + ::std::to_string(worker.pid));
+  }
+
+  uint32_t n_peaks;
+  if (!read_full(worker.from_worker, reinterpret_cast<char *>(&n_peaks), sizeof(n_peaks), deadline))
+    fail("worker " + ::std::to_string(worker.pid) + " timed out or exited");
+
+  if (n_peaks == WORKER_ERROR) {
+    uint32_t msg_len;
+    ::std::string msg;
+    if (!read_full(worker.from_worker, reinterpret_cast<char *>(&msg_len), sizeof(msg_len), deadline) || msg_len > MAX_WORKER_PEAKS)
+      fail("worker " + ::std::to_string(worker.pid) + " sent a malformed error");
+
+    msg.resize(msg_len);
+    if (!read_full(worker.from_worker, msg.data(), msg_len, deadline))
+      fail("worker " + ::std::to_string(worker.pid) + " sent a malformed error");
+
+    release(idx);
+    throw ::std::invalid_argument("Peak fit error -- " + msg);
+  }
+
+  if (n_peaks > MAX_WORKER_PEAKS)
+    fail("worker " + ::std::to_string(worker.pid) + " sent " + ::std::to_string(n_peaks) + " peaks");
+
+  ::std::vector<double> peak_mzs(n_peaks);
+  if (!read_full(worker.from_worker, reinterpret_cast<char *>(peak_mzs.data()), n_peaks * sizeof(double), deadline))
+    fail("worker " + ::std::to_string(worker.pid) + " timed out or exited");
+
+  release(idx);
+  return peak_mzs;
 }
@@ -12,8 +12,12 @@ int main(int argc, char **argv) {
 
   auto config = ::YAML::LoadFile(argv[1]);
   ::std::string reagent_ion = argv[2];
+  auto ion = ::Chem::ChemMap::get_chem_map()->get_reagant_ion(reagent_ion);
+  if (ion == ::Chem::ReagantIon::NONE)
+    throw ::std::invalid_argument("Unsupported reagent ion " + reagent_ion + ". Usage: ./src/api_driver <path to yaml config> <reagent ion <NH4|NO>>");
   
   resolve_paths(config);
+  CandidateIndex::build(ion, config["core"]["candidate_index"][reagent_ion + "_max_mz"].as<double>());
   
   CNum::Deploy::InferenceAPI< GBModel<XGTreeBooster>,
 			      Storage > rest_api(config["paths"]["api"][reagent_ion + "_model_path"].as<::std::string>(),
@@ -22,10 +26,22 @@ int main(int argc, char **argv) {
 						 config["api"]["allowed_origins"].as<::std::string>(),
 						 config["api"]["n_model_instances"].as<int>(),
 						 config["api"][reagent_ion + "_port"].as<unsigned short>());
+  init_result_cache(config);
+  init_ranking(config);
+  init_peak_fit(config);
+  init_audit(config);
 
   constexpr char url[::CNum::Deploy::MAX_URL_LEN] = "/process-graph"; // C-style string necessary here because ::std::string can't be constexpr until C++23
   constexpr ::CNum::Deploy::PathString url_path(url);
   rest_api.add_inference_route< url_path >(crow::HTTPMethod::Post, process_graph);
+
+  constexpr char predict_stream_url[::CNum::Deploy::MAX_URL_LEN] = "/predict-stream";
+  constexpr ::CNum::Deploy::PathString predict_stream_path(predict_stream_url);
+  rest_api.add_inference_route< predict_stream_path >(crow::HTTPMethod::Post, predict_stream);
+
+  constexpr char cache_stats_url[::CNum::Deploy::MAX_URL_LEN] = "/cache-stats";
+  constexpr ::CNum::Deploy::PathString cache_stats_path(cache_stats_url);
+  rest_api.add_inference_route< cache_stats_path >(crow::HTTPMethod::Get, cache_stats);
   rest_api.start();
   
   return 0;
@@ -3,6 +3,7 @@
 #include <yaml-cpp/yaml.h>
 #include <filesystem>
 #include <iostream>
+#include <numeric>
 
 #include "YamlHelpers.h"
 #include "Preprocess.h"
@@ -23,42 +24,83 @@ int main(int argc, char *argv[]) {
   auto combo_files_dir = data_dir + config["paths"]["core"]["data_combo_files_dir"].as<::std::string>();
   auto unidentified_combos_dir = combo_files_dir + config["paths"]["core"]["data_combo_unidentified_dir"].as<::std::string>();
   auto in_peak_list_path = config["paths"]["core"]["in_peak_list_dir"].as<::std::string>() + config["paths"]["core"]["in_peak_list_filename"].as<::std::string>();
-  ::std::filesystem::create_directories(peak_list_dir);
-  ::std::filesystem::create_directory(combo_files_dir);
+  auto write_peak_lists = config["core"]["data_prep"]["write_peak_lists"].as<bool>();
+  ::std::filesystem::create_directories(combo_files_dir);
   ::std::filesystem::create_directory(unidentified_combos_dir);
+
+  if (write_peak_lists)
+    ::std::filesystem::create_directories(peak_list_dir);
   
-  Preprocess::PrepareDataset::split_by_reagant_ion(in_peak_list_path,
-						   peak_list_dir);
+  // The input peak list is parsed and encoded once, everything after works on the peaks in memory
+  auto peak_lists = Preprocess::PrepareDataset::parse_peak_list_by_reagant_ion(in_peak_list_path, write_peak_lists);
 
   auto *cm = Chem::ChemMap::get_chem_map();
   const auto &reagant_ions = cm->get_reagant_ions();
 
-  int n_threads = deterministic ? 1 : ::std::thread::hardware_concurrency();
+  for (auto ion: reagant_ions)
+    CandidateIndex::build(ion, config["core"]["candidate_index"][cm->get_reagant_ion_name(ion) + "_max_mz"].as<double>());
+
+  int n_threads = ::std::max(::std::thread::hardware_concurrency(), 1u); // combo files are written in peak order regardless
+  auto combo_format = ::ComboFile::parse_format(config["core"]["combo_file_format"].as<::std::string>());
   ::std::array<::std::string, 2> test_train_ext({ "_test", "_train" });
-  for (const auto &ion: reagant_ions) {
-    auto peak_list_path = peak_list_dir + ion.val;
-    auto combo_file_path = combo_files_dir + ion.val;
-    auto unidentified_combos_path = unidentified_combos_dir + ion.val;
+  for (auto ion: reagant_ions) {
+    const auto &ion_name = cm->get_reagant_ion_name(ion);
+    auto peak_list_path = peak_list_dir + ion_name;
+    auto combo_file_path = combo_files_dir + ion_name;
+    auto unidentified_combos_path = unidentified_combos_dir + ion_name;
 
-    Preprocess::PrepareDataset::peak_list_train_test_split(peak_list_path + ".txt", peak_list_path, .1);
+    const auto &peak_list = peak_lists[ion];
+    auto split = Preprocess::PrepareDataset::shuffle_split(peak_list.peaks.mz.size(), .1);
+
+    // Same files the split used to go through, only needed for debugging now
+    if (write_peak_lists) {
+      ::std::vector<size_t> all_idx(peak_list.lines.size());
+      ::std::iota(all_idx.begin(), all_idx.end(), 0);
+      Preprocess::PrepareDataset::write_peak_list(peak_list_path + ".txt", peak_list, all_idx, true);
+      Preprocess::PrepareDataset::write_peak_list(peak_list_path + "_train.txt", peak_list, split[0], false);
+      Preprocess::PrepareDataset::write_peak_list(peak_list_path + "_test.txt", peak_list, split[1], false);
+    }
 
     Preprocess::Bias bias;
+    ::std::vector<Preprocess::WorkerStats> worker_stats;
     for (const auto &ext: test_train_ext) {
-      auto peak_list_data = Preprocess::PrepareDataset::parse_peak_list(peak_list_path + ext + ".txt");
-      auto encoded_unsimplified = Preprocess::encode_compounds(peak_list_data.compound_strings);
+      /* The train/test peak list files have no headers but parse_peak_list skipped their first line anyway,
+	 so the first peak of each split never made it into the combo files. Kept to reproduce existing datasets */
+      const auto &split_idx = ext == "_train" ? split[0] : split[1];
+      ::std::vector<size_t> combo_idx(split_idx.begin() + ::std::min<size_t>(1, split_idx.size()), split_idx.end());
+
+      auto split_peak_list = Preprocess::PrepareDataset::gather_peaks(peak_list, combo_idx);
+      const auto &peak_list_data = split_peak_list.peaks;
+      const auto &encoded_unsimplified = split_peak_list.encoded_unsimplified;
       auto encoded_simplified = Preprocess::simplify_compounds(encoded_unsimplified);
 
-      bias = Preprocess::PrepareDataset::create_combo_file(combo_file_path + ext + ".csv",
+      bias = Preprocess::PrepareDataset::create_combo_file(combo_file_path + ext + ::ComboFile::get_extension(combo_format),
 							   unidentified_combos_path + ext + "_unidentified_compounds.csv",
 							   ion,
 							   peak_list_data,
 							   encoded_unsimplified,
 							   encoded_simplified,
-							   n_threads);
+							   n_threads,
+							   combo_format,
+							   &worker_stats);
       
-      ::std::cout << ion.val << " Bias (" << ext.substr(1) << ")" << ": " << ::std::endl
+      ::std::cout << ion_name << " Bias (" << ext.substr(1) << ")" << ": " << ::std::endl
 		  << "Positive samples: " << bias.ones << ::std::endl
 		  << "Negative samples: " << bias.zeros << ::std::endl;
+
+      // Busy time per thread, a max far above the mean means the combo file work isn't balanced
+      auto [least_busy, most_busy] = ::std::minmax_element(worker_stats.begin(), worker_stats.end(), [] (const auto &a, const auto &b) {
+	return a.busy_seconds < b.busy_seconds;
+      });
+      double total_busy = ::std::accumulate(worker_stats.begin(), worker_stats.end(), 0.0, [] (double total, const auto &stats) {
+	return total + stats.busy_seconds;
+      });
+
+      if (!worker_stats.empty())
+	::std::cout << "Thread busy time (s): min " << least_busy->busy_seconds
+		    << ", mean " << total_busy / worker_stats.size()
+		    << ", max " << most_busy->busy_seconds
+		    << " over " << worker_stats.size() << " threads" << ::std::endl;
     }
   }
 
@@ -15,6 +15,10 @@ int main(int argc, char *argv[]) {
     throw ::std::invalid_argument("Invalid arguments. Usage: inference <path to yaml config> [NH4|NO]");
   }
 
+  auto ion = Chem::ChemMap::get_chem_map()->get_reagant_ion(argv[2]);
+  if (ion == Chem::ReagantIon::NONE)
+    throw ::std::invalid_argument("Invalid reagent ion " + ::std::string(argv[2]) + ". Usage: inference <path to yaml config> [NH4|NO]");
+
   auto config = ::YAML::LoadFile(argv[1]);
   auto run_dir = config["paths"]["core"]["run_root"].as<::std::string>() + config["run"]["run_id"].as<::std::string>() + "/";
   auto model_output_dir = run_dir + config["paths"]["core"]["model_output_dir"].as<::std::string>();
@@ -24,7 +28,7 @@ int main(int argc, char *argv[]) {
   
   ::std::cin >> mz;
   
-  auto data = Preprocess::mz_to_data(mz, { argv[2] });
+  auto data = Preprocess::mz_to_data(mz, ion);
   data.model_data.print_matrix();
   
   
@@ -32,10 +36,11 @@ int main(int argc, char *argv[]) {
   auto preds = xgboost.predict(data.model_data);
   Postprocess::sort_preds(data.encoded_compounds, preds, data.ppms);
 
-  auto dc = Preprocess::decode_compounds(data.encoded_compounds);
+  Preprocess::FormulaArena dc;
+  Preprocess::decode_compounds(data.encoded_compounds, &dc);
   
   for (int i = 0; i < dc.size(); i++)
-    std::cout << dc[i].val << " " << preds.get(i, 0) << " " << data.ppms.get(i, 0) << std::endl;
+    std::cout << dc[i] << " " << preds.get(i, 0) << " " << data.ppms.get(i, 0) << std::endl;
   
   return 0;
 }
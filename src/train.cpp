@@ -32,8 +32,17 @@ int main(int argc, char *argv[]) {
   auto train_combos_path = combo_dir + config["paths"]["core"]["data_combo_" + reagent_ion + "_train"].as<::std::string>();
   auto test_combos_path = combo_dir + config["paths"]["core"]["data_combo_" + reagent_ion + "_test"].as<::std::string>();
 
-  auto train = CNum::Data::get_data(train_combos_path);
-  auto test = CNum::Data::get_data(test_combos_path);
+  // The config names the csv files, binary combo files sit next to them with a different extension
+  auto combo_format = ::ComboFile::parse_format(config["core"]["combo_file_format"].as<::std::string>());
+  auto load_combos = [combo_format] (::std::filesystem::path path) {
+    if (combo_format == ::ComboFile::Format::BINARY)
+      return ::ComboFile::load(path.replace_extension(::ComboFile::get_extension(combo_format)));
+
+    return CNum::Data::get_data(path);
+  };
+
+  auto train = load_combos(train_combos_path);
+  auto test = load_combos(test_combos_path);
 
   if (config["run"]["deterministic"].as<bool>()) {
     int seed = config["run"]["cnum_model_train_seed"].as<int>();